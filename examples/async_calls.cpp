@@ -6,6 +6,7 @@ You should have received a copy of the GNU General Public License along with thi
 
 #include "AsyncFunctions.h"
 
+#include <array>
 #include <coroutine>
 #include <future>
 
@@ -403,6 +404,61 @@ asio::awaitable<int> mainCo() {
     tout() << std::endl;
   }
 
+  /**
+   * memoized async functions
+   *
+   * The first call computes the result on localPool. Later calls with the same arguments are answered from the cache.
+   */
+  tout() << "=== memoized" << std::endl;
+  {
+    auto TAG = "async_1_returns_ex_fun_memo";
+
+    auto computed = co_await async_1_returns_ex_fun_memo(false, 12, use_awaitable);
+    auto cached = co_await async_1_returns_ex_fun_memo(false, 12, use_awaitable); // does not visit localPool
+    auto stats = async_1_returns_ex_fun_cache.stats();
+    tout(TAG) << "Computed: " << computed << " Cached: " << cached << " hits: " << stats.hits << " misses: "
+              << stats.misses << std::endl;
+
+    tout() << std::endl;
+  }
+
+  /**
+   * batch async functions
+   *
+   * All inputs are computed in one dispatch to localPool. The results are written to the spans passed in.
+   */
+  tout() << "=== batch" << std::endl;
+  {
+    auto TAG = "async_2_returns_ex_fun_batch";
+
+    std::array<uint32_t, 8> inputs{1, 2, 3, 4, 5, 6, 7, 8};
+    std::array<double, 8> results1{};
+    std::array<double, 8> results2{};
+    auto [ret1, ret2] = co_await async_2_returns_ex_fun(false, inputs, results1, results2, use_awaitable);
+    for (size_t i = 0; i < ret1.size(); i++)
+      tout(TAG) << "Input: " << inputs[i] << " Ret1: " << ret1[i] << " Ret2: " << ret2[i] << std::endl;
+
+    tout() << std::endl;
+  }
+
+  /**
+   * inline completion
+   *
+   * A caller that opts in with `allow_immediate` lets a synchronous function run inside the call, without visiting localPool.
+   */
+  tout() << "=== inline" << std::endl;
+  {
+    auto TAG = "async_0_returns_ex_fun";
+
+    bool initiating = true;
+    async_0_returns_ex_fun(false, 12, allow_immediate([&](auto &&... /* std::exception_ptr */) {
+      tout(TAG) << "completed " << (initiating ? "inline" : "posted") << std::endl;
+    }));
+    initiating = false;
+
+    tout() << std::endl;
+  }
+
   tout("MainCo") << "Normal exit" << std::endl;
   co_return 0;
 }
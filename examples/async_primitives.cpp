@@ -0,0 +1,86 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * This example shows the awaitable synchronization primitives defined in `AsyncPrimitives.h`.
+ * Workers run on a multi-threaded pool without a strand.
+ * Each part of the shared state is protected by its own primitive.
+ */
+
+#include "AsyncPrimitives.h"
+
+#include <coroutine>
+#include <future>
+#include <string>
+#include <vector>
+
+namespace asio = boost::asio;
+
+using namespace AsyncPrimitives;
+
+struct SharedState {
+  /// All workers wait for this before they start.
+  async_event start;
+  /// Protects `log`. Held across a `co_await`, which a std::mutex must never be.
+  async_mutex log_mutex;
+  std::string log;
+  /// Allows two workers in the expensive section at a time.
+  async_semaphore expensive;
+  /// Protects nothing but the counter. Independent of `log_mutex`.
+  async_mutex counter_mutex;
+  size_t counter = 0;
+
+  explicit SharedState(const asio::any_io_executor &exe) : start{exe}, log_mutex{exe}, expensive{exe, 2},
+                                                           counter_mutex{exe} {}
+};
+
+asio::awaitable<void> worker(SharedState &state, size_t id) {
+  const constexpr auto TAG = "WRK";
+  auto exe = co_await asio::this_coro::executor;
+  auto timer = asio::steady_timer(exe);
+
+  co_await state.start.async_wait(asio::use_awaitable);
+
+  {
+    auto lock = co_await state.log_mutex.async_scoped_lock(asio::use_awaitable);
+    state.log += "[" + std::to_string(id);
+    timer.expires_after(std::chrono::milliseconds(10)); // suspends while holding the lock
+    co_await timer.async_wait(asio::use_awaitable);
+    state.log += "]";
+  }
+
+  co_await state.expensive.async_acquire(asio::use_awaitable);
+  tout(TAG) << id << " in expensive section, free units " << state.expensive.available() << std::endl;
+  timer.expires_after(std::chrono::milliseconds(50));
+  co_await timer.async_wait(asio::use_awaitable);
+  state.expensive.release();
+
+  co_await state.counter_mutex.async_lock(asio::use_awaitable);
+  state.counter++;
+  state.counter_mutex.unlock();
+}
+
+int main() {
+  const constexpr auto TAG = "MC";
+  asio::thread_pool pool{4};
+  SharedState state{pool.get_executor()};
+
+  const constexpr size_t WORKERS = 8;
+  std::vector<std::future<void>> done;
+  for (size_t id = 0; id < WORKERS; id++)
+    done.push_back(asio::co_spawn(pool, worker(state, id), asio::use_future));
+
+  tout(TAG) << "starting workers" << std::endl;
+  state.start.set();
+
+  for (auto &fut: done)
+    fut.get();
+  tout(TAG) << "log: " << state.log << std::endl // the brackets never interleave
+            << "counter: " << state.counter << std::endl;
+
+  pool.join();
+  return 0;
+}
@@ -0,0 +1,126 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * This benchmark checks that the caller side scales with the number of threads running the app context.
+ *
+ * The app context is run by a `ContextRunner`. Every thread gets one client on its own strand.
+ * Every client has its own service on its own service thread, so the services don't serialize the clients.
+ * With linear scaling the throughput grows with the thread count and the efficiency stays near 100%,
+ * as long as there are enough cores for the caller and the service threads.
+ * The busiest service thread is reported as well. If it approaches 100% the services limit the throughput, not the callers.
+ */
+
+#ifndef CAS_LOG_LEVEL
+#define CAS_LOG_LEVEL warn // measure the service, not the per operation logging
+#endif
+
+#include "ContextRunner.h"
+#include "ModernIOService.h"
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <ctime>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace asio = boost::asio;
+
+static const constexpr size_t OPS_PER_CLIENT = 20000;
+static const constexpr std::array<size_t, 4> THREAD_COUNTS{1, 2, 4, 8};
+
+/// Writes `OPS_PER_CLIENT` chunks.
+template<typename Service, typename CallerExecutor>
+std::future<void> spawn_client(Service &service, CallerExecutor exe) {
+  return asio::co_spawn(exe, [&service, exe]() mutable -> asio::awaitable<void> {
+    auto client = service.make_client(exe);
+    auto stream = client.make_my_async_stream();
+    const std::array<char, 16> chunk{};
+
+    for (size_t op = 0; op < OPS_PER_CLIENT; op++) {
+      auto [ec, n] = co_await stream.async_write_some(asio::buffer(chunk), use_nothrow_awaitable);
+      if (n != chunk.size()) // the stream completes writes with eof
+        throw boost::system::system_error{ec};
+    }
+  }, asio::use_future);
+}
+
+/// @return The CPU time used so far by the single thread of `ctx`.
+std::chrono::nanoseconds thread_cpu_time(asio::thread_pool &ctx) {
+  return asio::post(ctx, std::packaged_task<std::chrono::nanoseconds()>([] {
+    timespec time{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return std::chrono::seconds{time.tv_sec} + std::chrono::nanoseconds{time.tv_nsec};
+  })).get();
+}
+
+struct Result {
+  /// The writes per second of all clients.
+  double ops_per_second;
+  /// The CPU time of the busiest service thread relative to the run time.
+  double max_service_busy;
+};
+
+Result run(size_t threads) {
+  asio::io_context app_ctx{static_cast<int>(threads)};
+  ContextRunner runner{app_ctx, threads};
+  std::vector<std::unique_ptr<asio::thread_pool>> srv_ctxs;
+  for (size_t i = 0; i < threads; i++)
+    srv_ctxs.push_back(std::make_unique<asio::thread_pool>(1));
+
+  double seconds;
+  std::vector<std::chrono::nanoseconds> service_cpu;
+  {
+    std::vector<ModernIOService::ModernIOService<asio::thread_pool::executor_type>> services;
+    for (auto &srv_ctx: srv_ctxs)
+      services.emplace_back(srv_ctx->get_executor(), ModernIOService::ModernIOServiceOptions{.name = "bench"});
+    for (auto &srv_ctx: srv_ctxs)
+      service_cpu.push_back(thread_cpu_time(*srv_ctx));
+
+    runner.start();
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> clients;
+    for (size_t i = 0; i < threads; i++)
+      clients.push_back(spawn_client(services[i], runner.strand(i)));
+    for (auto &client: clients)
+      client.get();
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    for (size_t i = 0; i < threads; i++)
+      service_cpu[i] = thread_cpu_time(*srv_ctxs[i]) - service_cpu[i];
+  }
+
+  runner.stop();
+  runner.join();
+  for (auto &srv_ctx: srv_ctxs)
+    srv_ctx->join(); // the services finish their main loop
+
+  auto busiest = *std::max_element(service_cpu.begin(), service_cpu.end());
+  return {static_cast<double>(threads * OPS_PER_CLIENT) / seconds,
+          std::chrono::duration<double>(busiest).count() / seconds};
+}
+
+int main() {
+  const constexpr auto TAG = "MC";
+
+  auto table = fmt::format("{} writes per client, {} hardware threads\n{:>7} {:>12} {:>8} {:>10} {:>12}\n", OPS_PER_CLIENT,
+                           std::thread::hardware_concurrency(), "threads", "ops/s", "speedup", "efficiency",
+                           "service busy");
+  double baseline = 0;
+  for (auto threads: THREAD_COUNTS) {
+    tout(TAG) << "running with " << threads << " threads" << std::endl;
+    auto result = run(threads);
+    if (baseline == 0)
+      baseline = result.ops_per_second;
+    auto speedup = result.ops_per_second / baseline;
+    table += fmt::format("{:>7} {:>12.0f} {:>7.2f}x {:>9.0f}% {:>11.0f}%\n", threads, result.ops_per_second, speedup,
+                         100 * speedup / static_cast<double>(threads), 100 * result.max_service_busy);
+  }
+  tout(TAG) << table;
+  return 0;
+}
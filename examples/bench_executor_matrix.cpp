@@ -0,0 +1,187 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * This benchmark runs the same `ModernIOService` workload on every combination of
+ * service context, caller executor and thread count and prints a table of throughput and latency.
+ *
+ * Every client writes small chunks to its own `MyAsyncStream` and measures each `async_write_some`.
+ * A write hops from the caller executor to the service strand and back, so the table shows what these hops cost.
+ * Every client prewarms the service first, so the first writes don't show up as outliers in the max column.
+ * The "io_context spin" service context busy polls, which needs a free core per service thread to pay off.
+ *
+ * The services keep running their main loop after their row is done, the program waits for them at the end.
+ */
+
+#ifndef CAS_LOG_LEVEL
+#define CAS_LOG_LEVEL warn // measure the service, not the per operation logging
+#endif
+
+#include "ContextRunner.h"
+#include "ModernIOService.h"
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace asio = boost::asio;
+
+static const constexpr size_t CLIENTS = 8;
+static const constexpr size_t OPS_PER_CLIENT = 2000;
+static const constexpr std::array<size_t, 3> THREAD_COUNTS{1, 2, 4};
+/// The service buffers hold the writes of all clients until the main loop consumes them.
+static const constexpr size_t PREWARM_BYTES = 64 * 1024;
+
+/// Spin time of the busy polling service contexts.
+static const constexpr std::chrono::microseconds SPIN{50};
+
+/**
+ * An io_context that is run by `count` threads until it is destroyed.
+ * @tparam busy_poll The threads spin for `SPIN` before they park, so the service saves the kernel wakeup.
+ */
+template<bool busy_poll = false>
+class ThreadedIoContext {
+  asio::io_context ctx;
+  /// Waits until the work of the context is done when it is destroyed.
+  ContextRunner runner;
+public:
+  static const constexpr auto NAME = busy_poll ? "io_context spin" : "io_context";
+
+  explicit ThreadedIoContext(size_t count) : ctx{static_cast<int>(count)},
+                                             runner{ctx, count, {.spin = busy_poll ? SPIN : std::chrono::microseconds{0}}} {
+    runner.start();
+  }
+
+  auto get_executor() {
+    return ctx.get_executor();
+  }
+};
+
+/// A thread_pool that is joined instead of stopped when it is destroyed, so the services can finish their main loop.
+class JoinedThreadPool {
+  asio::thread_pool pool;
+public:
+  static const constexpr auto NAME = "thread_pool";
+
+  explicit JoinedThreadPool(size_t count) : pool{count} {}
+
+  ~JoinedThreadPool() {
+    pool.join();
+  }
+
+  auto get_executor() {
+    return pool.get_executor();
+  }
+};
+
+struct Row {
+  std::string service;
+  std::string caller;
+  size_t threads;
+  double ops_per_second;
+  double p50_us;
+  double p99_us;
+  double max_us;
+};
+
+/// Writes `OPS_PER_CLIENT` chunks and returns the latency of each write in microseconds.
+template<typename Service, typename CallerExecutor>
+std::future<std::vector<double>> spawn_client(Service &service, CallerExecutor exe) {
+  return asio::co_spawn(exe, [&service, exe]() mutable -> asio::awaitable<std::vector<double>> {
+    auto client = service.make_client(exe);
+    auto stream = client.make_my_async_stream();
+    const std::array<char, 16> chunk{};
+    co_await client.async_prewarm(PREWARM_BYTES, use_nothrow_awaitable);
+
+    std::vector<double> latencies;
+    latencies.reserve(OPS_PER_CLIENT);
+    for (size_t op = 0; op < OPS_PER_CLIENT; op++) {
+      auto start = std::chrono::steady_clock::now();
+      auto [ec, n] = co_await stream.async_write_some(asio::buffer(chunk), use_nothrow_awaitable);
+      auto elapsed = std::chrono::steady_clock::now() - start;
+      if (n != chunk.size()) // the stream completes writes with eof
+        throw boost::system::system_error{ec};
+      latencies.push_back(std::chrono::duration<double, std::micro>(elapsed).count());
+    }
+    co_return latencies;
+  }, asio::use_future);
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())))];
+}
+
+/**
+ * Runs the workload once.
+ * @param services Takes ownership of the service context, it is destroyed at the end of the program.
+ */
+template<typename ServiceContext, typename CallerContext, bool strand_per_client>
+Row run(size_t threads, std::vector<std::shared_ptr<void>> &services) {
+  auto srv_ctx = std::make_shared<ServiceContext>(threads);
+  services.push_back(srv_ctx);
+  std::vector<double> latencies;
+  double seconds;
+  {
+    CallerContext caller_ctx{threads};
+    auto service = ModernIOService::ModernIOService(srv_ctx->get_executor(), {.name = "bench"});
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::future<std::vector<double>>> clients;
+    for (size_t i = 0; i < CLIENTS; i++) {
+      if constexpr (strand_per_client)
+        clients.push_back(spawn_client(service, asio::make_strand(caller_ctx.get_executor())));
+      else
+        clients.push_back(spawn_client(service, caller_ctx.get_executor()));
+    }
+    for (auto &client: clients) {
+      auto client_latencies = client.get();
+      latencies.insert(latencies.end(), client_latencies.begin(), client_latencies.end());
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  return Row{ServiceContext::NAME, std::string{CallerContext::NAME} + (strand_per_client ? " strand" : ""), threads,
+             static_cast<double>(latencies.size()) / seconds, percentile(latencies, 0.5), percentile(latencies, 0.99),
+             latencies.back()};
+}
+
+template<typename ServiceContext>
+void run_callers(size_t threads, std::vector<Row> &rows, std::vector<std::shared_ptr<void>> &services) {
+  rows.push_back(run<ServiceContext, ThreadedIoContext<>, false>(threads, services));
+  rows.push_back(run<ServiceContext, ThreadedIoContext<>, true>(threads, services));
+  rows.push_back(run<ServiceContext, JoinedThreadPool, false>(threads, services));
+  rows.push_back(run<ServiceContext, JoinedThreadPool, true>(threads, services));
+}
+
+int main() {
+  const constexpr auto TAG = "MC";
+  std::vector<Row> rows;
+  std::vector<std::shared_ptr<void>> services;
+
+  for (auto threads: THREAD_COUNTS) {
+    tout(TAG) << "running with " << threads << " threads" << std::endl;
+    run_callers<ThreadedIoContext<>>(threads, rows, services);
+    run_callers<ThreadedIoContext<true>>(threads, rows, services);
+    run_callers<JoinedThreadPool>(threads, rows, services);
+  }
+
+  auto table = fmt::format("{} clients x {} writes\n{:<16} {:<20} {:>7} {:>12} {:>9} {:>9} {:>9}\n", CLIENTS,
+                           OPS_PER_CLIENT, "service", "caller", "threads", "ops/s", "p50 us", "p99 us", "max us");
+  for (auto &row: rows)
+    table += fmt::format("{:<16} {:<20} {:>7} {:>12.0f} {:>9.1f} {:>9.1f} {:>9.1f}\n", row.service, row.caller,
+                         row.threads, row.ops_per_second, row.p50_us, row.p99_us, row.max_us);
+  tout(TAG) << table;
+
+  tout(TAG) << "waiting for the services to finish their main loop" << std::endl;
+  services.clear();
+  return 0;
+}
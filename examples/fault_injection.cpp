@@ -0,0 +1,101 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * This example runs a client with a retry policy against a service with injected faults (`FaultInjection.h`).
+ * The service answers with a bimodal latency, fails some ops with `bad_descriptor` and stalls now and then.
+ * The client retries failed writes and reports how the retries shape the latency seen by the application.
+ */
+
+#ifndef CAS_LOG_LEVEL
+#define CAS_LOG_LEVEL warn // the interesting output is the summary
+#endif
+
+#include "ModernIOService.h"
+
+#include <algorithm>
+#include <array>
+#include <coroutine>
+#include <future>
+#include <vector>
+
+namespace asio = boost::asio;
+
+using namespace std::chrono_literals;
+
+static const constexpr size_t MESSAGES = 200;
+static const constexpr size_t MAX_ATTEMPTS = 3;
+
+asio::awaitable<int> mainCo(auto &srv_ctx) {
+  const constexpr auto TAG = "MC";
+  auto exe = co_await asio::this_coro::executor;
+  auto timer = asio::steady_timer(exe);
+  auto use_awaitable = asio::bind_executor(exe, asio::use_awaitable);
+  auto as_tuple = asio::experimental::as_tuple(use_awaitable);
+
+  auto service = ModernIOService::ModernIOService(srv_ctx.get_executor(), {.name = "faulty", .faults = FaultInjection::FaultProfile{
+    .latency = FaultInjection::bimodal_latency{.fast = 200us, .slow = 5ms, .slow_probability = 0.1},
+    .error_probability = 0.05,
+    .partial_read_probability = 0.5,
+    .stall_probability = 0.01,
+    .stall_duration = 20ms,
+    .seed = 1}});
+  auto client = service.make_client(exe);
+  auto stream = client.make_my_async_stream();
+
+  // writes with retries
+  {
+    const std::array<char, 16> message{};
+    std::vector<double> latencies;
+    size_t retries = 0, failures = 0;
+    for (size_t i = 0; i < MESSAGES; i++) {
+      auto start = std::chrono::steady_clock::now();
+      for (size_t attempt = 1; attempt <= MAX_ATTEMPTS; attempt++) {
+        auto [ec, n] = co_await stream.async_write_some(asio::buffer(message), as_tuple);
+        if (n == message.size()) // the stream completes writes with eof
+          break;
+        if (attempt == MAX_ATTEMPTS) {
+          tout(TAG) << "W: giving up on message " << i << ": " << ec.message() << std::endl;
+          failures++;
+        } else {
+          retries++;
+        }
+      }
+      latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    tout(TAG) << fmt::format("{} messages, {} retries, {} failed, latency p50 {:.2f}ms p99 {:.2f}ms max {:.2f}ms",
+                             MESSAGES, retries, failures, latencies[latencies.size() / 2],
+                             latencies[latencies.size() * 99 / 100], latencies.back()) << std::endl;
+  }
+
+  // partial reads are hidden by the composed read
+  {
+    timer.expires_after(std::chrono::milliseconds(1500)); // wait for the service to produce data
+    co_await timer.async_wait(use_awaitable);
+
+    std::array<char, 8> data{};
+    auto [ec, n] = co_await asio::async_read(stream, asio::buffer(data), as_tuple);
+    tout(TAG) << "read " << n << " bytes: " << std::string_view{data.data(), n} << " ec: " << ec.message() << std::endl;
+  }
+
+  auto stats = client.fault_stats();
+  tout(TAG) << "injected into " << stats.ops << " ops: " << stats.errors << " errors, " << stats.partial_reads
+            << " partial reads, " << stats.stalls << " stalls" << std::endl;
+  co_return 0;
+}
+
+int main() {
+  asio::io_context app_ctx;
+  asio::thread_pool srv_ctx{1};
+
+  auto fut = asio::co_spawn(asio::make_strand(app_ctx), mainCo(srv_ctx), asio::use_future);
+  app_ctx.run();
+
+  srv_ctx.join(); // the service thread stops here
+  return fut.get();
+}
@@ -0,0 +1,109 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Replaces the global allocation functions to feed the `AllocTracker`.
+ * Only linked when the CMake option `CAS_ALLOC_TRACKING` is on.
+ *
+ * Every block gets a header in front of it that remembers its size and tag.
+ * So a deallocation is attributed to the subsystem that allocated the block, no matter which thread frees it.
+ * The array forms are not replaced, by default they forward to the forms below.
+ */
+
+#include "AllocTracker.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace {
+  struct alignas(std::max_align_t) Header {
+    size_t size;
+    AllocTracker::Tag tag;
+  };
+
+  size_t header_size(size_t alignment) {
+    return std::max(sizeof(Header), alignment);
+  }
+
+  Header *header_of(void *ptr) {
+    return static_cast<Header *>(ptr) - 1;
+  }
+
+  void *allocate(size_t size, size_t alignment) noexcept {
+    auto total = header_size(alignment) + size;
+    void *base = alignment <= alignof(std::max_align_t)
+                 ? std::malloc(total)
+                 : std::aligned_alloc(alignment, (total + alignment - 1) / alignment * alignment);
+    if (base == nullptr)
+      return nullptr;
+
+    auto *ptr = static_cast<char *>(base) + header_size(alignment);
+    auto tag = AllocTracker::current_tag;
+    *header_of(ptr) = Header{size, tag};
+    AllocTracker::record_allocation(tag, size);
+    return ptr;
+  }
+
+  void *allocate_or_throw(size_t size, size_t alignment) {
+    while (true) {
+      if (auto *ptr = allocate(size, alignment))
+        return ptr;
+      auto handler = std::get_new_handler();
+      if (handler == nullptr)
+        throw std::bad_alloc{};
+      handler();
+    }
+  }
+
+  void deallocate(void *ptr, size_t alignment) noexcept {
+    if (ptr == nullptr)
+      return;
+    auto *header = header_of(ptr);
+    AllocTracker::record_deallocation(header->tag, header->size);
+    std::free(static_cast<char *>(ptr) - header_size(alignment));
+  }
+}
+
+void *operator new(size_t size) {
+  return allocate_or_throw(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment) {
+  return allocate_or_throw(size, static_cast<size_t>(alignment));
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return allocate(size, alignof(std::max_align_t));
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+  return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept {
+  deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void *ptr, std::align_val_t alignment) noexcept {
+  deallocate(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t alignment) noexcept {
+  deallocate(ptr, static_cast<size_t>(alignment));
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  deallocate(ptr, alignof(std::max_align_t));
+}
+
+void operator delete(void *ptr, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+  deallocate(ptr, static_cast<size_t>(alignment));
+}
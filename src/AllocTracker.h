@@ -0,0 +1,175 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_ALLOCTRACKER_H
+#define CUSTOMASIOSTREAMS_ALLOCTRACKER_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fmt/format.h>
+
+/**
+ * Opt-in attribution of heap allocations to subsystems.
+ *
+ * Enable it with the CMake option `CAS_ALLOC_TRACKING`.
+ * It defines `CAS_ALLOC_TRACKING` and links `AllocTracker.cpp`, which replaces the global `operator new` and `operator delete`.
+ * Every allocation is attributed to the tag that is active on the allocating thread.
+ * Tags are set with `CAS_ALLOC_SCOPE(tag)` or by allocating through a `tagged_allocator`.
+ *
+ * A scope must not span a `co_await` because the coroutine may resume on another thread.
+ * `co_spawn` creates the frame of the spawned coroutine after its first suspension, outside any scope.
+ * Such frames count as untagged. Only the spawn itself counts as `co_spawn_frames`.
+ *
+ * Without the option `CAS_ALLOC_SCOPE` compiles to nothing.
+ */
+namespace AllocTracker {
+  enum class Tag : uint8_t {
+    untagged,
+    stream_ops,
+    client_ops,
+    service_buffers,
+    co_spawn_frames,
+    logging,
+    async_functions,
+    count
+  };
+
+  static const constexpr size_t TAG_COUNT = static_cast<size_t>(Tag::count);
+
+  static const constexpr std::array<std::string_view, TAG_COUNT> TAG_NAMES{
+    "untagged", "stream_ops", "client_ops", "service_buffers", "co_spawn_frames", "logging", "async_functions"
+  };
+
+  struct Counters {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> deallocations{0};
+    std::atomic<uint64_t> allocated_bytes{0};
+    std::atomic<uint64_t> freed_bytes{0};
+  };
+
+  /// Updated by the replaced `operator new` and `operator delete`.
+  inline std::array<Counters, TAG_COUNT> counters{};
+
+  /// The tag new allocations of this thread are attributed to.
+  inline thread_local Tag current_tag = Tag::untagged;
+
+  inline void record_allocation(Tag tag, size_t size) noexcept {
+    auto &counter = counters[static_cast<size_t>(tag)];
+    counter.allocations.fetch_add(1, std::memory_order_relaxed);
+    counter.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  inline void record_deallocation(Tag tag, size_t size) noexcept {
+    auto &counter = counters[static_cast<size_t>(tag)];
+    counter.deallocations.fetch_add(1, std::memory_order_relaxed);
+    counter.freed_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  /// Attributes the allocations of this thread to `tag` until it is destroyed. Scopes can be nested.
+  class Scope {
+    Tag previous;
+  public:
+    explicit Scope(Tag tag) noexcept : previous{std::exchange(current_tag, tag)} {}
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() {
+      current_tag = previous;
+    }
+  };
+
+  /// An allocator that attributes its allocations to `tag`. Useful for containers that allocate outside any scope.
+  template<typename T, Tag tag>
+  struct tagged_allocator : std::allocator<T> {
+    using value_type = T;
+
+    template<typename U>
+    struct rebind {
+      using other = tagged_allocator<U, tag>;
+    };
+
+    tagged_allocator() = default;
+
+    template<typename U>
+    tagged_allocator(const tagged_allocator<U, tag> &) noexcept {}
+
+    T *allocate(size_t n) {
+      Scope scope{tag};
+      return std::allocator<T>::allocate(n);
+    }
+  };
+
+  struct Usage {
+    uint64_t allocations = 0;
+    uint64_t deallocations = 0;
+    uint64_t allocated_bytes = 0;
+    /// Allocated but not yet freed.
+    int64_t live_bytes = 0;
+  };
+
+  struct Snapshot {
+    std::chrono::steady_clock::time_point time;
+    std::array<Usage, TAG_COUNT> usage;
+  };
+
+  inline Snapshot snapshot() {
+    Snapshot snapshot{std::chrono::steady_clock::now(), {}};
+    for (size_t tag = 0; tag < TAG_COUNT; tag++) {
+      auto &counter = counters[tag];
+      auto &usage = snapshot.usage[tag];
+      usage.allocations = counter.allocations.load(std::memory_order_relaxed);
+      usage.deallocations = counter.deallocations.load(std::memory_order_relaxed);
+      usage.allocated_bytes = counter.allocated_bytes.load(std::memory_order_relaxed);
+      usage.live_bytes = static_cast<int64_t>(usage.allocated_bytes) -
+                         static_cast<int64_t>(counter.freed_bytes.load(std::memory_order_relaxed));
+    }
+    return snapshot;
+  }
+
+  /**
+   * Reports the allocations per subsystem over time.
+   * Every call to `sample()` shows the allocations since the previous call.
+   */
+  class Sampler {
+    Snapshot previous = snapshot();
+  public:
+    /// @return A table with the allocations since the previous sample and the live bytes.
+    std::string sample() {
+      auto current = snapshot();
+      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(current.time - previous.time);
+
+      auto table = fmt::format("allocations in the last {}ms\n{:<16} {:>8} {:>12} {:>12}\n", elapsed.count(),
+                               "subsystem", "count", "bytes", "live bytes");
+      for (size_t tag = 0; tag < TAG_COUNT; tag++) {
+        auto &now = current.usage[tag], &before = previous.usage[tag];
+        table += fmt::format("{:<16} {:>8} {:>12} {:>12}\n", TAG_NAMES[tag], now.allocations - before.allocations,
+                             now.allocated_bytes - before.allocated_bytes, now.live_bytes);
+      }
+      previous = current;
+      return table;
+    }
+  };
+}
+
+#ifdef CAS_ALLOC_TRACKING
+#define CAS_ALLOC_CONCAT_IMPL(a, b) a##b
+#define CAS_ALLOC_CONCAT(a, b) CAS_ALLOC_CONCAT_IMPL(a, b)
+/// Attributes the allocations until the end of the enclosing block to `AllocTracker::Tag::tag`.
+#define CAS_ALLOC_SCOPE(tag) const AllocTracker::Scope CAS_ALLOC_CONCAT(cas_alloc_scope_, __LINE__){AllocTracker::Tag::tag}
+#else
+#define CAS_ALLOC_SCOPE(tag) static_cast<void>(0)
+#endif
+
+#endif //CUSTOMASIOSTREAMS_ALLOCTRACKER_H
@@ -0,0 +1,152 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_ASYNCFUNCTIONTEMPLATE_H
+#define CUSTOMASIOSTREAMS_ASYNCFUNCTIONTEMPLATE_H
+
+#include "ConcurrencyLimiter.h"
+#include "Helpers.h"
+#include "ImmediateCompletion.h"
+
+#include <exception>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+
+/**
+ * Turns a body into a token generic async function.
+ *
+ * The body is a nullary callable that captures the arguments of the function.
+ * The completion signature is derived from what it returns:
+ * `T` or `asio::awaitable<T>` completes with `void(std::exception_ptr, T)`, `void` with `void(std::exception_ptr)`.
+ * These are the signatures of a `co_spawn`ed `asio::awaitable<T>`, so callers can't tell which strategy was picked.
+ *
+ * The cheapest strategy is picked, the first two at compile time:
+ *  - Inline: A synchronous body whose caller opted in with `allow_immediate` runs inside the initiating call
+ *    and completes through `complete_at_initiation`, like the other ops that know their result at initiation.
+ *    Only if a slot of the limiter is free right away and the thread may nest one more inline completion.
+ *  - Posted: Any other synchronous body is posted to the executor as a plain function object.
+ *    This is the stackless tier, no coroutine frame is allocated.
+ *  - Coroutine: A body returning `asio::awaitable<T>` is `co_spawn`ed, because it has to suspend.
+ *
+ * Without `allow_immediate` no tier completes inside the initiating call.
+ */
+namespace async_function_detail {
+  template<typename T>
+  struct awaitable_traits {
+    static const constexpr bool is_awaitable = false;
+    using value_type = T;
+  };
+
+  template<typename T, typename Executor>
+  struct awaitable_traits<asio::awaitable<T, Executor>> {
+    static const constexpr bool is_awaitable = true;
+    using value_type = T;
+  };
+
+  template<typename Body>
+  using body_traits = awaitable_traits<std::invoke_result_t<Body &>>;
+
+  template<typename T>
+  struct signature_of {
+    using type = void(std::exception_ptr, T);
+  };
+
+  template<>
+  struct signature_of<void> {
+    using type = void(std::exception_ptr);
+  };
+
+  /**
+   * Runs a synchronous body.
+   * @return The completion arguments. An exception thrown by the body is caught into the `std::exception_ptr`.
+   */
+  template<typename Body>
+  auto invoke_body(Body &body) {
+    using Value = typename body_traits<Body>::value_type;
+    std::exception_ptr error;
+    if constexpr (std::is_void_v<Value>) {
+      try {
+        body();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      return std::make_tuple(error);
+    } else {
+      Value value{};
+      try {
+        value = body();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      return std::make_tuple(error, std::move(value));
+    }
+  }
+
+  /// Runs a synchronous body on `executor` and dispatches the completion to the executor of the handler.
+  template<typename Body, typename Handler, typename Executor>
+  void post_body(const Executor &executor, Body body, Handler handler) {
+    auto comp_executor = asio::get_associated_executor(handler, executor);
+
+    asio::post(executor, [body = std::move(body), handler = std::move(handler),
+      workGuard = asio::make_work_guard(comp_executor)]() mutable {
+      asio::dispatch(workGuard.get_executor(), [handler = std::move(handler), result = invoke_body(body)]() mutable {
+        std::apply(std::move(handler), std::move(result));
+      });
+    });
+  }
+
+  /**
+   * Runs a synchronous body inside the initiating call if the caller allows it and a slot is free.
+   * @return False if the body must take one of the other tiers. Then `handler` and `body` are untouched.
+   */
+  template<typename Body, typename Handler, typename Executor>
+  bool try_run_inline(ConcurrencyLimiter *limiter, const Executor &executor, Body &body, Handler &handler) {
+    if (!immediate_completion::may_complete_inline<Handler>() || (limiter != nullptr && !limiter->try_admit()))
+      return false;
+    auto result = invoke_body(body);
+    if (limiter != nullptr) // like a `PermitHandler`, the slot is released before the handler runs
+      limiter->release();
+    auto comp_executor = asio::get_associated_executor(handler, executor);
+    std::apply([&](auto &&... args) {
+      complete_at_initiation(comp_executor, std::move(handler), std::forward<decltype(args)>(args)...);
+    }, std::move(result));
+    return true;
+  }
+}
+
+/// The completion signature of an async function generated from `Body`.
+template<typename Body>
+using async_body_signature =
+  typename async_function_detail::signature_of<typename async_function_detail::body_traits<Body>::value_type>::type;
+
+/**
+ * Starts `body` on `executor` under the control of `limiter` and completes `token`.
+ * @param limiter May be `nullptr`.
+ * @param body See `async_function_detail`. Exceptions thrown by it are delivered through the `std::exception_ptr`.
+ */
+template<typename Body, typename Executor, asio::completion_token_for<async_body_signature<Body>> CompletionToken>
+auto async_run_body(std::shared_ptr<ConcurrencyLimiter> limiter, const Executor &executor, Body body,
+                    CompletionToken &&token) {
+  return asio::async_initiate<CompletionToken, async_body_signature<Body>>(
+    [limiter = std::move(limiter), executor, body = std::move(body)](auto completion_handler) mutable {
+      if constexpr (!async_function_detail::body_traits<Body>::is_awaitable) {
+        if (async_function_detail::try_run_inline(limiter.get(), executor, body, completion_handler))
+          return;
+      }
+      limit_initiation<async_body_signature<Body>>(limiter, executor, std::move(completion_handler),
+        [body = std::move(body)](auto executor, auto handler) mutable {
+          if constexpr (async_function_detail::body_traits<Body>::is_awaitable) {
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(executor, std::move(body), std::move(handler));
+          } else {
+            async_function_detail::post_body(executor, std::move(body), std::move(handler));
+          }
+        });
+    }, token);
+}
+
+#endif //CUSTOMASIOSTREAMS_ASYNCFUNCTIONTEMPLATE_H
@@ -7,8 +7,13 @@ You should have received a copy of the GNU General Public License along with thi
 #ifndef CUSTOMASIOSTREAMS_ASYNCFUNCTIONS_H
 #define CUSTOMASIOSTREAMS_ASYNCFUNCTIONS_H
 
+#include "AsyncFunctionTemplate.h"
+#include "AsyncMemo.h"
+#include "ConcurrencyLimiter.h"
 #include "Helpers.h"
 
+#include <span>
+
 /**
  * This region contains async functions.
  *
@@ -30,87 +35,212 @@ You should have received a copy of the GNU General Public License along with thi
 
 inline static asio::thread_pool localPool{1};
 
+/**
+ * Bounds the number of async functions that run at the same time.
+ * Excess calls wait in a queue without a coroutine frame, so a burst of calls does not allocate a frame per call.
+ * Use `asyncFunctionsLimiter->configure(...)` to change the limit or the saturation policy.
+ */
+inline static const auto asyncFunctionsLimiter = std::make_shared<ConcurrencyLimiter>(64, saturation_policy::queue);
+
+/**
+ * Runs `body` on `localPool` under `asyncFunctionsLimiter`.
+ * Synchronous bodies are posted without a coroutine frame, see `AsyncFunctionTemplate.h`.
+ */
+template<typename Body, typename CompletionToken>
+auto async_on_local_pool(Body body, CompletionToken && token) {
+  CAS_ALLOC_SCOPE(async_functions);
+  return async_run_body(asyncFunctionsLimiter, localPool.get_executor(), std::move(body),
+                        std::forward<CompletionToken>(token));
+}
+
 typedef void (async_0_returns_ex_fun_return_type)();
 
 template<asio::completion_token_for<async_0_returns_ex_fun_return_type> CompletionToken>
 auto async_0_returns_ex_fun(bool failure, uint32_t inputParam, CompletionToken && token) {
-  return asio::co_spawn(localPool, [&, failure, inputParam] () -> asio::awaitable<void> {
+  return async_on_local_pool([failure, inputParam] () -> void {
     const constexpr auto TAG = "async_0_returns_ex_fun";
 
-    tout(TAG) << "input " << inputParam << std::endl;
+    CAS_LOG(debug, TAG) << "input " << inputParam << std::endl;
     if (failure)
       throw boost::system::error_code{asio::error::bad_descriptor};
     auto result = inputParam * 2.4;
-    tout(TAG) << "computed result " << result << std::endl;
-    co_return;
-  }, token);
+    CAS_LOG(debug, TAG) << "computed result " << result << std::endl;
+  }, std::forward<CompletionToken>(token));
 }
 
 typedef void (async_0_returns_ec_fun_return_type)(boost::system::error_code ec);
 
 template<asio::completion_token_for<async_0_returns_ec_fun_return_type> CompletionToken>
 auto async_0_returns_ec_fun(bool failure, uint32_t inputParam, CompletionToken && token) {
-  return asio::co_spawn(localPool, [&, failure, inputParam] () -> asio::awaitable<boost::system::error_code> {
+  return async_on_local_pool([failure, inputParam] () -> boost::system::error_code {
     const constexpr auto TAG = "async_0_returns_ec_fun";
 
-    tout(TAG) << "input " << inputParam << std::endl;
+    CAS_LOG(debug, TAG) << "input " << inputParam << std::endl;
     if (failure)
-      co_return boost::system::error_code{asio::error::bad_descriptor};
+      return boost::system::error_code{asio::error::bad_descriptor};
     auto result = inputParam * 2.4;
-    tout(TAG) << "computed result " << result << std::endl;
-    co_return boost::system::error_code{};
-  }, token);
+    CAS_LOG(debug, TAG) << "computed result " << result << std::endl;
+    return boost::system::error_code{};
+  }, std::forward<CompletionToken>(token));
 }
 
 typedef void (async_1_returns_ex_fun_return_type)(double exampleReturnValue1);
 
 template<asio::completion_token_for<async_1_returns_ex_fun_return_type> CompletionToken>
 auto async_1_returns_ex_fun(bool failure, uint32_t inputParam, CompletionToken && token) {
-  return asio::co_spawn(localPool, [&, failure, inputParam] () -> asio::awaitable<double> {
+  return async_on_local_pool([failure, inputParam] () -> double {
     const constexpr auto TAG = "async_1_returns_ex_fun";
 
-    tout(TAG) << "input " << inputParam << std::endl;
+    CAS_LOG(debug, TAG) << "input " << inputParam << std::endl;
     if (failure)
       throw boost::system::error_code{asio::error::bad_descriptor};
     auto result = inputParam * 2.4;
-    tout(TAG) << "computed result " << result << std::endl;
-    co_return result;
-  }, token);
+    CAS_LOG(debug, TAG) << "computed result " << result << std::endl;
+    return result;
+  }, std::forward<CompletionToken>(token));
 }
 
 typedef void (async_1_returns_ec_fun_return_type)(boost::system::error_code ec, double exampleReturnValue1);
 
 template<asio::completion_token_for<async_1_returns_ec_fun_return_type> CompletionToken>
 auto async_1_returns_ec_fun(bool failure, uint32_t inputParam, CompletionToken && token) {
-  return asio::co_spawn(localPool, [&, failure, inputParam] () -> asio::awaitable<std::tuple<boost::system::error_code, double>> {
+  return async_on_local_pool([failure, inputParam] () -> std::tuple<boost::system::error_code, double> {
     const constexpr auto TAG = "async_1_returns_ec_fun";
 
-    tout(TAG) << "input " << inputParam << std::endl;
+    CAS_LOG(debug, TAG) << "input " << inputParam << std::endl;
     if (failure)
-      co_return std::make_tuple(boost::system::error_code{asio::error::bad_descriptor}, 0.0);
+      return std::make_tuple(boost::system::error_code{asio::error::bad_descriptor}, 0.0);
     auto result = inputParam * 2.4;
-    tout(TAG) << "computed result " << result << std::endl;
-    co_return std::make_tuple(boost::system::error_code{}, result);
-  }, token);
+    CAS_LOG(debug, TAG) << "computed result " << result << std::endl;
+    return std::make_tuple(boost::system::error_code{}, result);
+  }, std::forward<CompletionToken>(token));
 }
 
 typedef void (async_2_returns_ex_fun_return_type)(double exampleReturnValue1, double exampleReturnValue2);
 
 template<asio::completion_token_for<async_2_returns_ex_fun_return_type> CompletionToken>
 auto async_2_returns_ex_fun(bool failure, uint32_t inputParam, CompletionToken && token) {
-  return asio::co_spawn(localPool, [&, failure, inputParam] () -> asio::awaitable<std::tuple<double, double>> {
+  return async_on_local_pool([failure, inputParam] () -> std::tuple<double, double> {
     const constexpr auto TAG = "async_2_returns_ex_fun";
 
-    tout(TAG) << "input " << inputParam << std::endl;
+    CAS_LOG(debug, TAG) << "input " << inputParam << std::endl;
     if (failure)
       throw boost::system::error_code{asio::error::bad_descriptor};
     auto result1 = inputParam * 2.4;
     auto result2 = inputParam * 3.4;
-    tout(TAG) << "computed result 1: " << result1 << " 2: " << result2 << std::endl;
-    co_return std::make_tuple(result1, result2);
-  }, token);
+    CAS_LOG(debug, TAG) << "computed result 1: " << result1 << " 2: " << result2 << std::endl;
+    return std::make_tuple(result1, result2);
+  }, std::forward<CompletionToken>(token));
 }
 
 // endregion async_functions
 
+/**
+ * This region contains batch variants of the async functions that compute a number for each input.
+ * A whole span of inputs is computed in one dispatch to `localPool`, which takes one slot of `asyncFunctionsLimiter`.
+ *
+ * The results are written to caller provided spans which are delivered with the completion, trimmed to the number of inputs.
+ * The spans must stay valid until the completion.
+ * Throws `invalid_argument` if a result span is shorter than the inputs.
+ */
+// region batch_async_functions
+
+namespace batch_detail {
+  /**
+   * Computes `inputs[i] * factor` for every input.
+   * Kept free of calls and branches, so Release builds turn it into SIMD conversions and multiplications.
+   * `inputs` and `results` have different element types, so they are known not to alias.
+   */
+  inline void scale(std::span<const uint32_t> inputs, double factor, std::span<double> results) {
+    const auto *in = inputs.data();
+    auto *out = results.data();
+    const auto count = inputs.size();
+    for (size_t i = 0; i < count; i++)
+      out[i] = in[i] * factor;
+  }
+}
+
+typedef void (async_1_returns_ex_fun_batch_return_type)(std::span<double> exampleReturnValues);
+
+template<asio::completion_token_for<async_1_returns_ex_fun_batch_return_type> CompletionToken>
+auto async_1_returns_ex_fun(bool failure, std::span<const uint32_t> inputParams, std::span<double> results,
+                            CompletionToken && token) {
+  return async_on_local_pool([failure, inputParams, results] () -> std::span<double> {
+    const constexpr auto TAG = "async_1_returns_ex_fun_batch";
+
+    CAS_LOG(debug, TAG) << "input " << inputParams.size() << " values" << std::endl;
+    if (failure)
+      throw boost::system::error_code{asio::error::bad_descriptor};
+    if (results.size() < inputParams.size())
+      throw boost::system::error_code{asio::error::invalid_argument};
+    auto computed = results.first(inputParams.size());
+    batch_detail::scale(inputParams, 2.4, computed);
+    CAS_LOG(debug, TAG) << "computed " << computed.size() << " results" << std::endl;
+    return computed;
+  }, std::forward<CompletionToken>(token));
+}
+
+typedef void (async_2_returns_ex_fun_batch_return_type)(std::span<double> exampleReturnValues1,
+                                                        std::span<double> exampleReturnValues2);
+
+template<asio::completion_token_for<async_2_returns_ex_fun_batch_return_type> CompletionToken>
+auto async_2_returns_ex_fun(bool failure, std::span<const uint32_t> inputParams, std::span<double> results1,
+                            std::span<double> results2, CompletionToken && token) {
+  return async_on_local_pool([failure, inputParams, results1, results2] () -> std::tuple<std::span<double>, std::span<double>> {
+    const constexpr auto TAG = "async_2_returns_ex_fun_batch";
+
+    CAS_LOG(debug, TAG) << "input " << inputParams.size() << " values" << std::endl;
+    if (failure)
+      throw boost::system::error_code{asio::error::bad_descriptor};
+    if (results1.size() < inputParams.size() || results2.size() < inputParams.size())
+      throw boost::system::error_code{asio::error::invalid_argument};
+    auto computed1 = results1.first(inputParams.size());
+    auto computed2 = results2.first(inputParams.size());
+    batch_detail::scale(inputParams, 2.4, computed1);
+    batch_detail::scale(inputParams, 3.4, computed2);
+    CAS_LOG(debug, TAG) << "computed " << computed1.size() << " result pairs" << std::endl;
+    return std::make_tuple(computed1, computed2);
+  }, std::forward<CompletionToken>(token));
+}
+
+// endregion batch_async_functions
+
+/**
+ * This region contains memoized variants of the async functions with a return value.
+ * Concurrent calls with the same arguments share one computation and repeated calls are answered from a cache.
+ * A cache hit completes without visiting `localPool`.
+ *
+ * They complete with `(std::exception_ptr, value)` like the wrapped functions.
+ */
+// region memoized_async_functions
+
+inline static AsyncMemo<double(bool, uint32_t)> async_1_returns_ex_fun_cache{1024};
+
+template<asio::completion_token_for<async_1_returns_ex_fun_return_type> CompletionToken>
+auto async_1_returns_ex_fun_memo(bool failure, uint32_t inputParam, CompletionToken && token) {
+  return async_1_returns_ex_fun_cache.async_call([](bool failure, uint32_t inputParam, auto handler) {
+    async_1_returns_ex_fun(failure, inputParam, std::move(handler));
+  }, failure, inputParam, std::forward<CompletionToken>(token));
+}
+
+inline static AsyncMemo<std::tuple<boost::system::error_code, double>(bool, uint32_t)> async_1_returns_ec_fun_cache{1024};
+
+template<asio::completion_token_for<async_1_returns_ec_fun_return_type> CompletionToken>
+auto async_1_returns_ec_fun_memo(bool failure, uint32_t inputParam, CompletionToken && token) {
+  return async_1_returns_ec_fun_cache.async_call([](bool failure, uint32_t inputParam, auto handler) {
+    async_1_returns_ec_fun(failure, inputParam, std::move(handler));
+  }, failure, inputParam, std::forward<CompletionToken>(token));
+}
+
+inline static AsyncMemo<std::tuple<double, double>(bool, uint32_t)> async_2_returns_ex_fun_cache{1024};
+
+template<asio::completion_token_for<async_2_returns_ex_fun_return_type> CompletionToken>
+auto async_2_returns_ex_fun_memo(bool failure, uint32_t inputParam, CompletionToken && token) {
+  return async_2_returns_ex_fun_cache.async_call([](bool failure, uint32_t inputParam, auto handler) {
+    async_2_returns_ex_fun(failure, inputParam, std::move(handler));
+  }, failure, inputParam, std::forward<CompletionToken>(token));
+}
+
+// endregion memoized_async_functions
+
 #endif //CUSTOMASIOSTREAMS_ASYNCFUNCTIONS_H
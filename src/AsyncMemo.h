@@ -0,0 +1,212 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_ASYNCMEMO_H
+#define CUSTOMASIOSTREAMS_ASYNCMEMO_H
+
+#include "Helpers.h"
+
+#include <exception>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+template<typename Signature>
+class AsyncMemo;
+
+/**
+ * Memoizes a pure async computation with an LRU cache keyed on its arguments.
+ *
+ * Single flight: concurrent callers with the same arguments share one in-flight computation.
+ * A cache hit completes on the associated executor of the handler without running the computation,
+ * so it never visits the executor the computation runs on.
+ * Failed computations are not cached, their exception is delivered to every waiting caller.
+ *
+ * The completion signature is `void(std::exception_ptr, Value)`, the one of a `co_spawn`ed `asio::awaitable<Value>`.
+ * Thread safe. The memo must outlive its computations.
+ *
+ * @tparam Value The result. Must be copyable and default constructible.
+ * @tparam Args The arguments. They form the key and must be copyable and ordered.
+ */
+template<typename Value, typename... Args>
+class AsyncMemo<Value(Args...)> {
+public:
+  using Key = std::tuple<Args...>;
+  typedef void async_call_handler(std::exception_ptr, Value);
+
+  struct Stats {
+    uint64_t hits = 0;
+    /// Calls that joined a computation started by another caller.
+    uint64_t shared = 0;
+    uint64_t misses = 0;
+  };
+
+private:
+  class Waiter {
+  public:
+    virtual ~Waiter() = default;
+
+    virtual void complete(std::exception_ptr error, const Value &value) = 0;
+  };
+
+  template<typename Handler, typename WorkGuard>
+  class WaiterOp final : public Waiter {
+    Handler handler;
+    WorkGuard workGuard;
+  public:
+    WaiterOp(Handler &&handler, WorkGuard &&workGuard) : handler{std::move(handler)},
+                                                         workGuard{std::move(workGuard)} {}
+
+    void complete(std::exception_ptr error, const Value &value) override {
+      asio::post(workGuard.get_executor(), [handler = std::move(handler), error, value]() mutable {
+        std::move(handler)(error, value);
+      });
+    }
+  };
+
+  /**
+   * Passed to the computation. Fills the cache and completes the waiters.
+   * Move only, so that exactly one instance owns the flight.
+   * If it is destroyed without being invoked, e.g. because the executor of the computation was stopped,
+   * the flight fails with `operation_aborted`. Otherwise later callers would join a flight that never finishes.
+   */
+  class ComputationHandler {
+    /// `nullptr` once the flight is finished or the handler was moved from.
+    AsyncMemo *memo;
+    Key key;
+  public:
+    ComputationHandler(AsyncMemo *memo, Key key) : memo{memo}, key{std::move(key)} {}
+
+    ComputationHandler(ComputationHandler &&other) noexcept : memo{std::exchange(other.memo, nullptr)},
+                                                              key{std::move(other.key)} {}
+    ComputationHandler &operator=(ComputationHandler &&) = delete;
+
+    ComputationHandler(const ComputationHandler &) = delete;
+    ComputationHandler &operator=(const ComputationHandler &) = delete;
+
+    ~ComputationHandler() {
+      if (memo != nullptr) // destroyed without being invoked, moved from and finished handlers don't build the exception
+        fail(std::make_exception_ptr(boost::system::error_code{asio::error::operation_aborted})); // the async functions throw error codes
+    }
+
+    /// Variadic so that the async functions accept it for any of their documented signatures.
+    template<typename... Results>
+    void operator()(Results &&... results) {
+      std::exchange(memo, nullptr)->finish(key, std::forward<Results>(results)...);
+    }
+
+    /// Fails the flight with `error` unless it is finished already or another instance owns it.
+    void fail(std::exception_ptr error) {
+      if (memo != nullptr)
+        std::exchange(memo, nullptr)->finish(key, error, Value{});
+    }
+  };
+
+  struct Entry {
+    Value value;
+    /// Position in `lru`.
+    typename std::list<Key>::iterator position;
+  };
+
+  std::mutex mutex;
+  const size_t capacity;
+  /// Most recently used first.
+  std::list<Key> lru;
+  std::map<Key, Entry> cache;
+  std::map<Key, std::vector<std::unique_ptr<Waiter>>> in_flight;
+  Stats stats_;
+
+  void finish(const Key &key, std::exception_ptr error, Value value) {
+    std::vector<std::unique_ptr<Waiter>> waiters;
+    {
+      std::lock_guard lock{mutex};
+      auto flight = in_flight.find(key);
+      waiters = std::move(flight->second);
+      in_flight.erase(flight);
+
+      if (error == nullptr && capacity != 0) {
+        lru.push_front(key);
+        cache.insert_or_assign(key, Entry{value, lru.begin()});
+        if (cache.size() > capacity) {
+          cache.erase(lru.back());
+          lru.pop_back();
+        }
+      }
+    }
+    for (auto &waiter: waiters)
+      waiter->complete(error, value);
+  }
+
+public:
+  /// @param capacity The number of results kept. Zero only shares in-flight computations.
+  explicit AsyncMemo(size_t capacity) : capacity{capacity} {}
+
+  AsyncMemo(const AsyncMemo &) = delete;
+  AsyncMemo &operator=(const AsyncMemo &) = delete;
+
+  /**
+   * Returns the cached result or runs `compute(args..., handler)`.
+   * @param compute Starts the computation. `handler` must be invoked with `(std::exception_ptr, Value)`.
+   *                If `compute` throws or drops `handler`, the waiting callers complete with the exception or `operation_aborted`.
+   */
+  template<typename Compute, asio::completion_token_for<async_call_handler> CompletionToken>
+  auto async_call(Compute compute, Args... args, CompletionToken &&token) {
+    return asio::async_initiate<CompletionToken, async_call_handler>(
+      [this, compute = std::move(compute), key = Key{std::move(args)...}](auto completion_handler) mutable {
+        auto comp_executor = asio::get_associated_executor(completion_handler);
+        std::unique_ptr<Waiter> waiter = std::make_unique<WaiterOp<decltype(completion_handler),
+          decltype(asio::make_work_guard(comp_executor))>>(std::move(completion_handler),
+                                                            asio::make_work_guard(comp_executor));
+
+        std::unique_lock lock{mutex};
+        if (auto hit = cache.find(key); hit != cache.end()) {
+          stats_.hits++;
+          lru.splice(lru.begin(), lru, hit->second.position);
+          auto value = hit->second.value;
+          lock.unlock();
+          waiter->complete(nullptr, value);
+          return;
+        }
+
+        auto [flight, first] = in_flight.try_emplace(key);
+        flight->second.push_back(std::move(waiter));
+        if (!first) {
+          stats_.shared++;
+          return;
+        }
+        stats_.misses++;
+        lock.unlock();
+
+        // If `compute` throws after taking the handler, its destruction fails the flight with `operation_aborted`.
+        ComputationHandler handler{this, key};
+        try {
+          std::apply([&](const Args &... args) {
+            compute(args..., std::move(handler));
+          }, key);
+        } catch (...) {
+          handler.fail(std::current_exception());
+        }
+      }, token);
+  }
+
+  Stats stats() {
+    std::lock_guard lock{mutex};
+    return stats_;
+  }
+
+  /// Forgets all cached results. In-flight computations are not affected.
+  void clear() {
+    std::lock_guard lock{mutex};
+    cache.clear();
+    lru.clear();
+  }
+};
+
+#endif //CUSTOMASIOSTREAMS_ASYNCMEMO_H
@@ -0,0 +1,330 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_ASYNCPRIMITIVES_H
+#define CUSTOMASIOSTREAMS_ASYNCPRIMITIVES_H
+
+#include "Helpers.h"
+
+#include <cassert>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+/**
+ * Synchronization primitives that suspend the waiting operation instead of blocking the thread.
+ *
+ * They are thread safe and can be shared by coroutines running on different threads of a multi-threaded executor.
+ * So state that needs protection can get its own mutex instead of serializing everything through one strand.
+ *
+ * Waiters are served in FIFO order. A released unit is handed directly to the first waiter, so no late caller can barge in.
+ * Completions are always posted to the associated executor of the handler, never invoked inside the initiating call.
+ * The executor passed to the constructor is used for handlers without an associated executor.
+ */
+namespace AsyncPrimitives {
+  namespace detail {
+    class Waiter {
+    public:
+      virtual ~Waiter() = default;
+
+      /// Posts the completion. Must be called without holding the mutex of the primitive.
+      virtual void complete(boost::system::error_code ec) = 0;
+    };
+
+    template<typename Handler, typename WorkGuard>
+    class WaiterOp final : public Waiter {
+      Handler handler;
+      /// Keeps the caller executor alive while waiting.
+      WorkGuard workGuard;
+    public:
+      WaiterOp(Handler &&handler, WorkGuard &&workGuard) : handler{std::move(handler)},
+                                                           workGuard{std::move(workGuard)} {}
+
+      void complete(boost::system::error_code ec) override {
+        asio::post(workGuard.get_executor(), [handler = std::move(handler), ec]() mutable {
+          std::move(handler)(ec);
+        });
+      }
+    };
+
+    template<typename Handler>
+    std::unique_ptr<Waiter> make_waiter(Handler &&handler, const asio::any_io_executor &fallback) {
+      auto comp_executor = asio::get_associated_executor(handler, fallback);
+      return std::make_unique<WaiterOp<std::decay_t<Handler>, decltype(asio::make_work_guard(comp_executor))>>(
+        std::forward<Handler>(handler), asio::make_work_guard(comp_executor));
+    }
+
+    inline void complete_all(std::deque<std::unique_ptr<Waiter>> &waiters, boost::system::error_code ec) {
+      for (auto &waiter: waiters)
+        waiter->complete(ec);
+    }
+  }
+
+  typedef void async_wait_handler(boost::system::error_code);
+
+  class async_mutex;
+
+  /// A counting semaphore.
+  class async_semaphore {
+    friend async_mutex;
+
+    const asio::any_io_executor executor;
+    std::mutex mutex;
+    size_t count;
+    std::deque<std::unique_ptr<detail::Waiter>> waiters;
+
+    /// Completes `waiter` right away if a unit is available, otherwise it waits in the queue.
+    void acquire(std::unique_ptr<detail::Waiter> waiter) {
+      {
+        std::lock_guard lock{mutex};
+        if (count == 0 || !waiters.empty()) {
+          waiters.push_back(std::move(waiter));
+          return;
+        }
+        count--;
+      }
+      waiter->complete({});
+    }
+
+  public:
+    explicit async_semaphore(asio::any_io_executor executor, size_t initial_count) : executor{std::move(executor)},
+                                                                                      count{initial_count} {}
+
+    async_semaphore(const async_semaphore &) = delete;
+    async_semaphore &operator=(const async_semaphore &) = delete;
+
+    /// Aborts the waiters.
+    ~async_semaphore() {
+      cancel();
+    }
+
+    /// @return Takes a unit if one is available without waiting.
+    bool try_acquire() {
+      std::lock_guard lock{mutex};
+      if (count == 0 || !waiters.empty())
+        return false;
+      count--;
+      return true;
+    }
+
+    /// Takes a unit. Waits until one is released if none is available.
+    template<asio::completion_token_for<async_wait_handler> CompletionToken>
+    auto async_acquire(CompletionToken &&token) {
+      return asio::async_initiate<CompletionToken, async_wait_handler>(
+        [this](auto completion_handler) {
+          acquire(detail::make_waiter(std::move(completion_handler), executor));
+        }, token);
+    }
+
+    /// Returns `n` units. They are handed to the waiters first.
+    void release(size_t n = 1) {
+      std::deque<std::unique_ptr<detail::Waiter>> granted;
+      {
+        std::lock_guard lock{mutex};
+        for (; n != 0 && !waiters.empty(); n--) {
+          granted.push_back(std::move(waiters.front()));
+          waiters.pop_front();
+        }
+        count += n;
+      }
+      detail::complete_all(granted, {});
+    }
+
+    /// Completes all waiters with `operation_aborted`.
+    void cancel() {
+      std::deque<std::unique_ptr<detail::Waiter>> aborted;
+      {
+        std::lock_guard lock{mutex};
+        aborted.swap(waiters);
+      }
+      detail::complete_all(aborted, asio::error::operation_aborted);
+    }
+
+    asio::any_io_executor get_executor() const {
+      return executor;
+    }
+
+    /// @return The number of units available right now.
+    size_t available() {
+      std::lock_guard lock{mutex};
+      return count;
+    }
+  };
+
+  /// A mutex that is not bound to a thread. It may be unlocked by a different thread than the one that locked it.
+  class async_mutex {
+    async_semaphore semaphore;
+
+  public:
+    /// Unlocks the mutex on destruction. Default constructed guards own nothing.
+    class scoped_lock {
+      async_mutex *mutex = nullptr;
+    public:
+      scoped_lock() = default;
+
+      explicit scoped_lock(async_mutex &mutex) : mutex{&mutex} {}
+
+      scoped_lock(scoped_lock &&other) noexcept: mutex{std::exchange(other.mutex, nullptr)} {}
+
+      scoped_lock &operator=(scoped_lock &&other) noexcept {
+        unlock();
+        mutex = std::exchange(other.mutex, nullptr);
+        return *this;
+      }
+
+      ~scoped_lock() {
+        unlock();
+      }
+
+      bool owns_lock() const {
+        return mutex != nullptr;
+      }
+
+      void unlock() {
+        if (mutex != nullptr)
+          std::exchange(mutex, nullptr)->unlock();
+      }
+    };
+
+  private:
+    /// The guard owns the mutex from the moment it is granted, so a completion that is dropped unlocks it.
+    template<typename Handler, typename WorkGuard>
+    class ScopedLockWaiterOp final : public detail::Waiter {
+      async_mutex &mutex;
+      Handler handler;
+      /// Keeps the caller executor alive while waiting.
+      WorkGuard workGuard;
+    public:
+      ScopedLockWaiterOp(async_mutex &mutex, Handler &&handler, WorkGuard &&workGuard)
+        : mutex{mutex}, handler{std::move(handler)}, workGuard{std::move(workGuard)} {}
+
+      void complete(boost::system::error_code ec) override {
+        asio::post(workGuard.get_executor(),
+                   [handler = std::move(handler), ec, lock = ec ? scoped_lock{} : scoped_lock{mutex}]() mutable {
+                     std::move(handler)(ec, std::move(lock));
+                   });
+      }
+    };
+
+  public:
+
+    explicit async_mutex(asio::any_io_executor executor) : semaphore{std::move(executor), 1} {}
+
+    asio::any_io_executor get_executor() const {
+      return semaphore.get_executor();
+    }
+
+    bool try_lock() {
+      return semaphore.try_acquire();
+    }
+
+    template<asio::completion_token_for<async_wait_handler> CompletionToken>
+    auto async_lock(CompletionToken &&token) {
+      return semaphore.async_acquire(std::forward<CompletionToken>(token));
+    }
+
+    typedef void async_scoped_lock_handler(boost::system::error_code, scoped_lock);
+
+    /**
+     * Like `async_lock` but the completion gets a guard that unlocks the mutex.
+     * The mutex is unlocked as well if the completion is destroyed without being invoked, e.g. when its executor shuts down.
+     */
+    template<asio::completion_token_for<async_scoped_lock_handler> CompletionToken>
+    auto async_scoped_lock(CompletionToken &&token) {
+      return asio::async_initiate<CompletionToken, async_scoped_lock_handler>(
+        [this](auto completion_handler) {
+          auto comp_executor = asio::get_associated_executor(completion_handler, semaphore.get_executor());
+          semaphore.acquire(std::make_unique<ScopedLockWaiterOp<decltype(completion_handler),
+            decltype(asio::make_work_guard(comp_executor))>>(
+            *this, std::move(completion_handler), asio::make_work_guard(comp_executor)));
+        }, token);
+    }
+
+    /// Hands the mutex to the next waiter. The mutex must be locked.
+    void unlock() {
+      assert(semaphore.available() == 0 && "async_mutex unlocked more often than locked");
+      semaphore.release();
+    }
+
+    /// Completes all waiters with `operation_aborted`.
+    void cancel() {
+      semaphore.cancel();
+    }
+  };
+
+  /// A manual reset event. While it is set waits complete right away.
+  class async_event {
+    const asio::any_io_executor executor;
+    std::mutex mutex;
+    bool set_ = false;
+    std::deque<std::unique_ptr<detail::Waiter>> waiters;
+
+  public:
+    explicit async_event(asio::any_io_executor executor) : executor{std::move(executor)} {}
+
+    asio::any_io_executor get_executor() const {
+      return executor;
+    }
+
+    async_event(const async_event &) = delete;
+    async_event &operator=(const async_event &) = delete;
+
+    /// Aborts the waiters.
+    ~async_event() {
+      cancel();
+    }
+
+    /// Sets the event and wakes all waiters.
+    void set() {
+      std::deque<std::unique_ptr<detail::Waiter>> woken;
+      {
+        std::lock_guard lock{mutex};
+        set_ = true;
+        woken.swap(waiters);
+      }
+      detail::complete_all(woken, {});
+    }
+
+    void reset() {
+      std::lock_guard lock{mutex};
+      set_ = false;
+    }
+
+    bool is_set() {
+      std::lock_guard lock{mutex};
+      return set_;
+    }
+
+    /// Waits until the event is set.
+    template<asio::completion_token_for<async_wait_handler> CompletionToken>
+    auto async_wait(CompletionToken &&token) {
+      return asio::async_initiate<CompletionToken, async_wait_handler>(
+        [this](auto completion_handler) {
+          auto waiter = detail::make_waiter(std::move(completion_handler), executor);
+          {
+            std::lock_guard lock{mutex};
+            if (!set_) {
+              waiters.push_back(std::move(waiter));
+              return;
+            }
+          }
+          waiter->complete({});
+        }, token);
+    }
+
+    /// Completes all waiters with `operation_aborted`.
+    void cancel() {
+      std::deque<std::unique_ptr<detail::Waiter>> aborted;
+      {
+        std::lock_guard lock{mutex};
+        aborted.swap(waiters);
+      }
+      detail::complete_all(aborted, asio::error::operation_aborted);
+    }
+  };
+}
+
+#endif //CUSTOMASIOSTREAMS_ASYNCPRIMITIVES_H
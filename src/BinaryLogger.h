@@ -0,0 +1,358 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_BINARYLOGGER_H
+#define CUSTOMASIOSTREAMS_BINARYLOGGER_H
+
+#include "Helpers.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+/**
+ * A logger that defers the formatting.
+ *
+ * A log statement copies a pointer to its call site and its raw arguments into a ring buffer of the logging thread.
+ * The call site holds the level, the tag and the fmt format string, its address serves as the format id.
+ * A background thread drains the buffers, formats the records with fmt and prints them like `tout`.
+ * So a statement costs a few stores instead of a format and a locked write to `std::cout`.
+ *
+ * Arguments must be arithmetic, enums or strings. Strings are copied into the record.
+ * When the buffer of a thread is full records are dropped, the logging thread never blocks. Drops are reported.
+ * Records of one thread are printed in order, records of different threads are not ordered.
+ * The background thread sleeps while nothing is logged, a thread wakes it when its buffer stops being empty.
+ *
+ * Use it through `CAS_BLOG`, which applies the compile time filter of `CAS_LOG`.
+ */
+namespace BinaryLogger {
+  /// The static description of a log statement.
+  struct Site {
+    log_level level;
+    const char *tag;
+    const char *format;
+  };
+
+  namespace detail {
+    /// How an argument is copied into a record and read back.
+    template<typename T, typename = void>
+    struct Codec {
+      static_assert(sizeof(T) == 0, "Only arithmetic values, enums and strings can be logged deferred");
+    };
+
+    template<typename T>
+    struct Codec<T, std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>>> {
+      static size_t size(const T &) {
+        return sizeof(T);
+      }
+
+      static void write(std::byte *&data, const T &value) {
+        std::memcpy(data, &value, sizeof(T));
+        data += sizeof(T);
+      }
+
+      static auto read(const std::byte *&data) {
+        T value;
+        std::memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        if constexpr (std::is_enum_v<T>)
+          return static_cast<std::underlying_type_t<T>>(value);
+        else
+          return value;
+      }
+    };
+
+    template<typename T>
+    struct Codec<T, std::enable_if_t<std::is_convertible_v<const T &, std::string_view> && !std::is_arithmetic_v<T>>> {
+      static size_t size(const T &value) {
+        return sizeof(uint32_t) + std::string_view{value}.size();
+      }
+
+      static void write(std::byte *&data, const T &value) {
+        std::string_view view{value};
+        auto length = static_cast<uint32_t>(view.size());
+        std::memcpy(data, &length, sizeof(length));
+        std::memcpy(data + sizeof(length), view.data(), length);
+        data += sizeof(length) + length;
+      }
+
+      /// Points into the record, valid while it is formatted.
+      static std::string_view read(const std::byte *&data) {
+        uint32_t length;
+        std::memcpy(&length, data, sizeof(length));
+        std::string_view view{reinterpret_cast<const char *>(data + sizeof(length)), length};
+        data += sizeof(length) + length;
+        return view;
+      }
+    };
+
+    template<typename T>
+    using codec_t = Codec<std::decay_t<const T>>;
+
+    using Formatter = std::string (*)(const Site &site, const std::byte *arguments);
+
+    template<typename... Args>
+    std::string format_record(const Site &site, const std::byte *arguments) {
+      // braced initialization reads the arguments from left to right
+      std::tuple values{codec_t<Args>::read(arguments)...};
+      return std::apply([&](const auto &... values) {
+        return fmt::vformat(site.format, fmt::make_format_args(values...));
+      }, values);
+    }
+
+    struct RecordHeader {
+      /// `nullptr` marks padding up to the end of the ring.
+      Formatter formatter;
+      const Site *site;
+      std::chrono::steady_clock::rep timestamp;
+      /// Including the header.
+      size_t size;
+    };
+
+    static const constexpr size_t RECORD_ALIGNMENT = alignof(RecordHeader);
+
+    constexpr size_t align_record(size_t size) {
+      return (size + RECORD_ALIGNMENT - 1) / RECORD_ALIGNMENT * RECORD_ALIGNMENT;
+    }
+
+    /// A single producer single consumer byte ring. Records never wrap, the rest of the ring is skipped instead.
+    class Buffer {
+      std::unique_ptr<std::byte[]> data;
+      const size_t capacity;
+      /// Only written by the logging thread.
+      std::atomic<size_t> head{0};
+      /// Only written by the background thread.
+      std::atomic<size_t> tail{0};
+      std::atomic<uint64_t> dropped{0};
+    public:
+      const std::string prefix;
+
+      Buffer(size_t capacity, std::string prefix) : data{std::make_unique<std::byte[]>(capacity)}, capacity{capacity},
+                                                    prefix{std::move(prefix)} {}
+
+      /**
+       * Called by the logging thread. `fill` writes `size` bytes.
+       * @return True if the background thread may have seen the buffer empty before this record and must be woken.
+       */
+      template<typename Fill>
+      bool try_write(size_t size, Fill &&fill) {
+        auto start = head.load(std::memory_order_relaxed);
+        auto position = start;
+        auto free = capacity - (position - tail.load(std::memory_order_acquire));
+        auto contiguous = capacity - position % capacity;
+        auto skip = contiguous < size ? contiguous : 0;
+        if (skip + size > free) {
+          dropped.fetch_add(1, std::memory_order_relaxed);
+          return false;
+        }
+        if (skip >= sizeof(RecordHeader)) {
+          RecordHeader padding{nullptr, nullptr, 0, skip};
+          std::memcpy(data.get() + position % capacity, &padding, sizeof(padding));
+        }
+        position += skip;
+        fill(data.get() + position % capacity);
+        // Pairs with `drain`: either the drain sees this head or we see its tail and wake it up.
+        head.store(position + size, std::memory_order_seq_cst);
+        return tail.load(std::memory_order_seq_cst) == start;
+      }
+
+      /// Called by the background thread. Calls `consume(header, arguments)` for every record.
+      template<typename Consume>
+      size_t drain(Consume &&consume) {
+        size_t records = 0;
+        auto position = tail.load(std::memory_order_relaxed);
+        auto end = head.load(std::memory_order_acquire);
+        while (position != end) {
+          auto contiguous = capacity - position % capacity;
+          if (contiguous < sizeof(RecordHeader)) {
+            position += contiguous;
+            continue;
+          }
+          RecordHeader header;
+          std::memcpy(&header, data.get() + position % capacity, sizeof(header));
+          if (header.formatter != nullptr) {
+            consume(header, data.get() + position % capacity + sizeof(header));
+            records++;
+          }
+          position += header.size;
+        }
+        tail.store(position, std::memory_order_seq_cst);
+        return records;
+      }
+
+      /// Called by the background thread after `drain`.
+      bool empty() const {
+        return head.load(std::memory_order_seq_cst) == tail.load(std::memory_order_relaxed);
+      }
+
+      uint64_t take_dropped() {
+        return dropped.exchange(0, std::memory_order_relaxed);
+      }
+    };
+  }
+
+  /**
+   * Drains the buffers of all threads on a background thread.
+   *
+   * The instance is never destroyed, so threads that outlive the static objects can still log.
+   * The remaining records are printed at exit, later ones are lost.
+   */
+  class Backend {
+    std::mutex mutex;
+    std::atomic<bool> stopping{false};
+    /// Bumped to wake the background thread.
+    std::atomic<uint32_t> wakeups{0};
+    std::vector<std::shared_ptr<detail::Buffer>> buffers;
+    /// Timestamps are printed relative to this.
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    /// Serializes the draining of the background thread and of `flush`.
+    std::mutex drain_mutex;
+    std::thread worker;
+
+    /// @return True if all buffers were empty after they were drained.
+    bool drain_all() {
+      std::lock_guard drain_lock{drain_mutex};
+      bool all_empty = true;
+      std::vector<std::shared_ptr<detail::Buffer>> current;
+      {
+        std::lock_guard lock{mutex};
+        current = buffers;
+      }
+      for (auto &buffer: current) {
+        buffer->drain([&](const detail::RecordHeader &header, const std::byte *arguments) {
+          auto captured = std::chrono::steady_clock::time_point{std::chrono::steady_clock::duration{header.timestamp}};
+          auto line = buffer->prefix + fmt::format("+{}us ",
+            std::chrono::duration_cast<std::chrono::microseconds>(captured - start).count());
+          if (*header.site->tag != '\0')
+            line.append(header.site->tag).append(" ");
+          try {
+            line += header.formatter(*header.site, arguments);
+          } catch (const fmt::format_error &error) {
+            line.append("E: bad log format \"").append(header.site->format).append("\": ").append(error.what());
+          }
+          line += '\n';
+          std::cout << line;
+        });
+        if (auto dropped = buffer->take_dropped(); dropped != 0)
+          std::cout << buffer->prefix << "W: dropped " << dropped << " log records\n";
+        all_empty = all_empty && buffer->empty();
+      }
+      std::cout.flush();
+
+      current.clear();
+      std::lock_guard lock{mutex};
+      std::erase_if(buffers, [](const auto &buffer) {
+        return buffer.use_count() == 1 && buffer->empty(); // the thread has exited
+      });
+      return all_empty;
+    }
+
+    Backend() : worker{[this] {
+      while (!stopping.load()) {
+        auto seen = wakeups.load();
+        if (drain_all())
+          wakeups.wait(seen); // returns at once if a thread logged since `seen`
+      }
+    }} {}
+
+    /// Never called, the worker thread is joined by `shutdown()`.
+    ~Backend() = default;
+
+  public:
+    static const constexpr size_t BUFFER_CAPACITY = 64 * 1024;
+
+    Backend(const Backend &) = delete;
+    Backend &operator=(const Backend &) = delete;
+
+    /// Leaked on purpose, see the class comment.
+    static Backend &instance() {
+      static Backend &backend = [] () -> Backend & {
+        auto *created = new Backend;
+        std::atexit([] {
+          BinaryLogger::Backend::instance().shutdown();
+        });
+        return *created;
+      }();
+      return backend;
+    }
+
+    /// Wakes up the background thread.
+    void notify() {
+      wakeups.fetch_add(1);
+      wakeups.notify_one();
+    }
+
+    /// Stops the background thread and prints the remaining records. Later records are only printed by `flush()`.
+    void shutdown() {
+      if (stopping.exchange(true))
+        return;
+      notify();
+      worker.join();
+      drain_all();
+    }
+
+    /// The buffer of the calling thread. It outlives the thread until it is drained.
+    detail::Buffer &local_buffer() {
+      thread_local std::shared_ptr<detail::Buffer> buffer = [this] {
+        CAS_ALLOC_SCOPE(logging);
+        auto created = std::make_shared<detail::Buffer>(BUFFER_CAPACITY, thread_prefix());
+        std::lock_guard lock{mutex};
+        buffers.push_back(created);
+        return created;
+      }();
+      return *buffer;
+    }
+
+    /// Prints all records logged before the call.
+    void flush() {
+      drain_all();
+    }
+  };
+
+  template<typename... Args>
+  void write(const Site &site, const Args &... args) {
+    using namespace detail;
+    auto size = align_record(sizeof(RecordHeader) + (size_t{0} + ... + codec_t<Args>::size(args)));
+    auto &backend = Backend::instance();
+    auto became_non_empty = backend.local_buffer().try_write(size, [&](std::byte *data) {
+      RecordHeader header{&format_record<Args...>, &site, std::chrono::steady_clock::now().time_since_epoch().count(),
+                          size};
+      std::memcpy(data, &header, sizeof(header));
+      data += sizeof(header);
+      (codec_t<Args>::write(data, args), ...);
+    });
+    if (became_non_empty)
+      backend.notify();
+  }
+
+  inline void flush() {
+    Backend::instance().flush();
+  }
+}
+
+/**
+ * Logs through the `BinaryLogger`. Filtered like `CAS_LOG`, `tag` and `format` must be constant expressions.
+ *
+ * Usage: `CAS_BLOG(trace, TAG, "moving {} bytes", chunk.size());`
+ */
+#define CAS_BLOG(level, tag, format, ...) \
+  do { \
+    if constexpr (log_filter::enabled(log_level::level, tag)) { \
+      static constexpr BinaryLogger::Site cas_blog_site{log_level::level, tag, format}; \
+      BinaryLogger::write(cas_blog_site __VA_OPT__(,) __VA_ARGS__); \
+    } \
+  } while (false)
+
+#endif //CUSTOMASIOSTREAMS_BINARYLOGGER_H
@@ -0,0 +1,330 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_CONCURRENCYLIMITER_H
+#define CUSTOMASIOSTREAMS_CONCURRENCYLIMITER_H
+
+#include "Helpers.h"
+
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+
+/// What happens to an initiation when all slots of a `ConcurrencyLimiter` are taken.
+enum class saturation_policy {
+  /// Wait in the queue until a slot is released.
+  queue,
+  /// Complete right away with `try_again`. Signatures without an error channel are queued instead.
+  reject,
+  /// Start right away from within the initiating call, without taking a slot. The limit becomes a soft limit.
+  run_inline
+};
+
+/**
+ * Bounds the number of running operations of one function family.
+ *
+ * An initiation that can't start is not spawned.
+ * Only its handler and its arguments are kept in an intrusive queue node, so a burst does not allocate coroutine frames.
+ * The slot is released when the completion handler is invoked (or destroyed), which starts the next queued initiation.
+ *
+ * Thread safe. Use it through `limit_initiation` or `async_limited`.
+ */
+class ConcurrencyLimiter : public std::enable_shared_from_this<ConcurrencyLimiter> {
+public:
+  /// A node of the intrusive queue.
+  class QueuedInitiation {
+    friend ConcurrencyLimiter;
+    QueuedInitiation *next = nullptr;
+  public:
+    virtual ~QueuedInitiation() = default;
+
+    /// Starts the operation. It owns a slot of `limiter`.
+    virtual void start(std::shared_ptr<ConcurrencyLimiter> limiter) = 0;
+
+    /// Completes the operation without starting it.
+    virtual void abort(boost::system::error_code ec) = 0;
+  };
+
+private:
+  mutable std::mutex mutex;
+  /// Zero means unlimited.
+  size_t max_concurrent;
+  saturation_policy policy;
+  size_t running_count = 0;
+  size_t queued_count = 0;
+  QueuedInitiation *head = nullptr;
+  QueuedInitiation *tail = nullptr;
+
+public:
+  enum class admission {
+    /// A slot was taken.
+    start,
+    /// The node was queued and is owned by the limiter now.
+    queued,
+    rejected,
+    run_inline
+  };
+
+  explicit ConcurrencyLimiter(size_t max_concurrent = 0, saturation_policy policy = saturation_policy::queue)
+    : max_concurrent{max_concurrent}, policy{policy} {}
+
+  ConcurrencyLimiter(const ConcurrencyLimiter &) = delete;
+  ConcurrencyLimiter &operator=(const ConcurrencyLimiter &) = delete;
+
+  /// Aborts the queued initiations. Running ones keep the limiter alive.
+  ~ConcurrencyLimiter() {
+    while (head != nullptr) {
+      std::unique_ptr<QueuedInitiation> node{std::exchange(head, head->next)};
+      node->abort(asio::error::operation_aborted);
+    }
+  }
+
+  /// Changes the limit. Zero means unlimited. Raising it starts queued initiations.
+  void configure(size_t new_max_concurrent, saturation_policy new_policy) {
+    {
+      std::lock_guard lock{mutex};
+      max_concurrent = new_max_concurrent;
+      policy = new_policy;
+    }
+    start_queued();
+  }
+
+  size_t running() const {
+    std::lock_guard lock{mutex};
+    return running_count;
+  }
+
+  size_t queued() const {
+    std::lock_guard lock{mutex};
+    return queued_count;
+  }
+
+  /**
+   * Takes a slot or applies the saturation policy.
+   * @param make_node Creates the queue node. Only called when the initiation is queued.
+   * @param can_reject If the completion signature has an error channel.
+   */
+  template<typename MakeNode>
+  admission admit(MakeNode &&make_node, bool can_reject) {
+    std::lock_guard lock{mutex};
+    if (max_concurrent == 0 || (running_count < max_concurrent && head == nullptr)) {
+      running_count++;
+      return admission::start;
+    }
+    if (policy == saturation_policy::run_inline)
+      return admission::run_inline;
+    if (policy == saturation_policy::reject && can_reject)
+      return admission::rejected;
+
+    auto *node = make_node().release();
+    if (tail == nullptr)
+      head = node;
+    else
+      tail->next = node;
+    tail = node;
+    queued_count++;
+    return admission::queued;
+  }
+
+  /**
+   * Takes a slot if one is free right away. Never queues and ignores the saturation policy.
+   * @return True if a slot was taken, it must be given back with `release()`.
+   */
+  bool try_admit() {
+    std::lock_guard lock{mutex};
+    if (max_concurrent != 0 && (running_count >= max_concurrent || head != nullptr))
+      return false;
+    running_count++;
+    return true;
+  }
+
+  /// Releases a slot. The slot is handed to the next queued initiation.
+  void release() {
+    {
+      std::lock_guard lock{mutex};
+      running_count--;
+    }
+    start_queued();
+  }
+
+private:
+  void start_queued() {
+    while (true) {
+      std::unique_ptr<QueuedInitiation> node;
+      {
+        std::lock_guard lock{mutex};
+        if (head == nullptr || (max_concurrent != 0 && running_count >= max_concurrent))
+          return;
+        node.reset(std::exchange(head, head->next));
+        if (head == nullptr)
+          tail = nullptr;
+        queued_count--;
+        running_count++;
+      }
+      node->start(shared_from_this());
+    }
+  }
+};
+
+namespace limiter_detail {
+  /// Releases the slot of the operation before the wrapped handler is invoked.
+  template<typename Handler>
+  class PermitHandler {
+    Handler handler;
+    std::shared_ptr<ConcurrencyLimiter> limiter;
+  public:
+    PermitHandler(Handler &&handler, std::shared_ptr<ConcurrencyLimiter> limiter) : handler{std::move(handler)},
+                                                                                   limiter{std::move(limiter)} {}
+
+    PermitHandler(PermitHandler &&) noexcept = default;
+
+    const Handler &get() const {
+      return handler;
+    }
+
+    ~PermitHandler() {
+      if (limiter != nullptr) // destroyed without being invoked
+        limiter->release();
+    }
+
+    template<typename... Args>
+    void operator()(Args &&... args) {
+      std::exchange(limiter, nullptr)->release();
+      std::move(handler)(std::forward<Args>(args)...);
+    }
+  };
+
+  /// The completion arguments of a rejected or aborted initiation.
+  template<typename Signature>
+  struct rejection;
+
+  template<typename... Args>
+  struct rejection<void(Args...)> {
+    using arguments = std::tuple<std::decay_t<Args>...>;
+    using first = std::tuple_element_t<0, std::tuple<std::decay_t<Args>..., void>>;
+
+    static const constexpr bool possible =
+      std::is_same_v<first, std::exception_ptr> || std::is_same_v<first, boost::system::error_code>;
+
+    static arguments make(boost::system::error_code ec) {
+      arguments args{};
+      if constexpr (std::is_same_v<first, std::exception_ptr>)
+        std::get<0>(args) = std::make_exception_ptr(ec); // the async functions throw error codes
+      else if constexpr (std::is_same_v<first, boost::system::error_code>)
+        std::get<0>(args) = ec;
+      return args;
+    }
+  };
+
+  template<typename Signature, typename Handler, typename Executor, typename Start>
+  class QueuedInitiationOp final : public ConcurrencyLimiter::QueuedInitiation {
+    Handler handler;
+    Executor executor;
+    Start start_function;
+  public:
+    QueuedInitiationOp(Handler &&handler, Executor executor, Start &&start_function)
+      : handler{std::move(handler)}, executor{std::move(executor)}, start_function{std::move(start_function)} {}
+
+    void start(std::shared_ptr<ConcurrencyLimiter> limiter) override {
+      std::move(start_function)(executor, PermitHandler<Handler>{std::move(handler), std::move(limiter)});
+    }
+
+    /// Handlers without an error channel can't be told and are destroyed.
+    void abort(boost::system::error_code ec) override {
+      if constexpr (rejection<Signature>::possible) {
+        auto comp_executor = asio::get_associated_executor(handler, executor);
+        asio::post(comp_executor, [handler = std::move(handler), ec]() mutable {
+          std::apply(std::move(handler), rejection<Signature>::make(ec));
+        });
+      }
+    }
+  };
+}
+
+// The permit is transparent: the executor, allocator and cancellation slot of the wrapped handler are used.
+
+template<typename Handler, typename Executor>
+struct boost::asio::associated_executor<limiter_detail::PermitHandler<Handler>, Executor> {
+  using type = associated_executor_t<Handler, Executor>;
+
+  static type get(const limiter_detail::PermitHandler<Handler> &permit, const Executor &executor = Executor()) noexcept {
+    return asio::get_associated_executor(permit.get(), executor);
+  }
+};
+
+template<typename Handler, typename Allocator>
+struct boost::asio::associated_allocator<limiter_detail::PermitHandler<Handler>, Allocator> {
+  using type = associated_allocator_t<Handler, Allocator>;
+
+  static type get(const limiter_detail::PermitHandler<Handler> &permit, const Allocator &allocator = Allocator()) noexcept {
+    return asio::get_associated_allocator(permit.get(), allocator);
+  }
+};
+
+template<typename Handler, typename CancellationSlot>
+struct boost::asio::associated_cancellation_slot<limiter_detail::PermitHandler<Handler>, CancellationSlot> {
+  using type = associated_cancellation_slot_t<Handler, CancellationSlot>;
+
+  static type get(const limiter_detail::PermitHandler<Handler> &permit,
+                  const CancellationSlot &slot = CancellationSlot()) noexcept {
+    return asio::get_associated_cancellation_slot(permit.get(), slot);
+  }
+};
+
+/**
+ * Use inside an initiation function to start the operation under the control of `limiter`.
+ * @tparam Signature The completion signature. Used to complete rejected initiations.
+ * @param limiter May be `nullptr`, then the operation starts right away.
+ * @param executor The executor the operation runs on when it gets a slot.
+ * @param start Called as `start(executor, handler)` when the operation may run.
+ */
+template<typename Signature, typename Handler, typename Executor, typename Start>
+void limit_initiation(const std::shared_ptr<ConcurrencyLimiter> &limiter, const Executor &executor, Handler &&handler,
+                      Start &&start) {
+  using Node = limiter_detail::QueuedInitiationOp<Signature, std::decay_t<Handler>, Executor, std::decay_t<Start>>;
+  using Rejection = limiter_detail::rejection<Signature>;
+
+  if (limiter == nullptr) {
+    std::forward<Start>(start)(executor, std::forward<Handler>(handler));
+    return;
+  }
+
+  switch (limiter->admit([&] {
+    return std::make_unique<Node>(std::forward<Handler>(handler), executor, std::forward<Start>(start));
+  }, Rejection::possible)) {
+    case ConcurrencyLimiter::admission::start:
+      std::forward<Start>(start)(executor, limiter_detail::PermitHandler<std::decay_t<Handler>>{std::forward<Handler>(handler),
+                                                                                        limiter});
+      break;
+    case ConcurrencyLimiter::admission::queued:
+      break;
+    case ConcurrencyLimiter::admission::rejected:
+      if constexpr (Rejection::possible) {
+        auto comp_executor = asio::get_associated_executor(handler, executor);
+        asio::post(comp_executor, [handler = std::forward<Handler>(handler)]() mutable {
+          std::apply(std::move(handler), Rejection::make(asio::error::try_again));
+        });
+      }
+      break;
+    case ConcurrencyLimiter::admission::run_inline:
+      std::forward<Start>(start)(executor, std::forward<Handler>(handler));
+      break;
+  }
+}
+
+/// Like `asio::async_initiate` but the operation is started through `limit_initiation`.
+template<typename Signature, typename CompletionToken, typename Executor, typename Start>
+auto async_limited(std::shared_ptr<ConcurrencyLimiter> limiter, const Executor &executor, Start &&start,
+                   CompletionToken &&token) {
+  return asio::async_initiate<CompletionToken, Signature>(
+    [limiter = std::move(limiter), executor, start = std::forward<Start>(start)](auto completion_handler) mutable {
+      limit_initiation<Signature>(limiter, executor, std::move(completion_handler), std::move(start));
+    }, token);
+}
+
+#endif //CUSTOMASIOSTREAMS_CONCURRENCYLIMITER_H
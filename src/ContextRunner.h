@@ -0,0 +1,180 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_CONTEXTRUNNER_H
+#define CUSTOMASIOSTREAMS_CONTEXTRUNNER_H
+
+#include "Helpers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// How the threads of a `ContextRunner` wait for handlers.
+struct ContextRunnerOptions {
+  /**
+   * Spin with `poll()` for this long after the last handler before parking in `run_one()`.
+   * A handler posted while the thread spins runs without a kernel wakeup, at the cost of a busy core.
+   * Zero blocks in `run()`.
+   */
+  std::chrono::microseconds spin{0};
+  /**
+   * Thread `i` is pinned to the core `cpus[i % cpus.size()]`. Empty leaves the placement to the scheduler.
+   * Only supported on Linux. Pair it with cores that are isolated from the scheduler (`isolcpus`) for busy polling.
+   */
+  std::vector<int> cpus;
+};
+
+/**
+ * Runs an `io_context` on multiple threads.
+ *
+ * Handlers of the plain context executor may run concurrently.
+ * Independent clients should each get one of the strands of the runner, so their handlers are serialized
+ * without serializing the clients against each other. There is one strand per thread.
+ *
+ * `stop()` stops gracefully: the threads return once the outstanding work is done.
+ * `stop_now()` abandons the outstanding work.
+ * If a handler throws the context is stopped and `join()` rethrows the first exception.
+ *
+ * For low latency the threads can busy poll and be pinned to cores, see `ContextRunnerOptions`.
+ */
+class ContextRunner {
+public:
+  using strand_type = asio::strand<asio::io_context::executor_type>;
+
+private:
+  asio::io_context &ctx;
+  const ContextRunnerOptions options;
+  std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work_guard;
+  std::vector<strand_type> strands;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::exception_ptr failure;
+
+  /// Tells the core that this is a spin loop, so it can save power and yield to its hyper thread.
+  static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  /// Runs the context until it is stopped or runs out of work. Spins before every park.
+  void run_polling() {
+    while (!ctx.stopped()) {
+      auto spin_end = std::chrono::steady_clock::now() + options.spin;
+      size_t handlers;
+      while ((handlers = ctx.poll()) == 0 && !ctx.stopped() && std::chrono::steady_clock::now() < spin_end)
+        cpu_relax();
+      if (handlers == 0 && !ctx.stopped())
+        ctx.run_one(); // park until the next handler
+    }
+  }
+
+  /// Pins the calling thread. Called by each thread before it runs the context, so none of its handlers run elsewhere.
+  static void pin_this_thread(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (auto err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); err != 0) {
+      CAS_LOG(warn, "Runner") << "W: Could not pin a thread to cpu " << cpu << ": " << std::system_category().message(err)
+                              << std::endl;
+    }
+#else
+    CAS_LOG(warn, "Runner") << "W: Pinning threads is not supported on this platform" << std::endl;
+#endif
+  }
+
+public:
+  /// @param thread_count The number of threads started by `start()`. Also the number of strands.
+  ContextRunner(asio::io_context &ctx, size_t thread_count, ContextRunnerOptions options = {}) : ctx{ctx},
+                                                                                                 options{std::move(options)} {
+    for (size_t i = 0; i < std::max<size_t>(1, thread_count); i++)
+      strands.push_back(asio::make_strand(ctx));
+  }
+
+  ContextRunner(const ContextRunner &) = delete;
+  ContextRunner &operator=(const ContextRunner &) = delete;
+
+  /// Stops gracefully and waits for the threads. Exceptions of handlers are swallowed, call `join()` to get them.
+  ~ContextRunner() {
+    stop();
+    try {
+      join();
+    } catch (...) {}
+  }
+
+  /// Starts the threads. They keep running without work until `stop()` is called.
+  void start() {
+    work_guard.emplace(ctx.get_executor());
+    if (ctx.stopped())
+      ctx.restart();
+    for (size_t i = 0; i < strands.size(); i++)
+      threads.emplace_back([this, i] {
+        if (!options.cpus.empty())
+          pin_this_thread(options.cpus[i % options.cpus.size()]);
+        try {
+          if (options.spin.count() == 0)
+            ctx.run();
+          else
+            run_polling();
+        } catch (...) {
+          std::lock_guard lock{mutex};
+          if (failure == nullptr)
+            failure = std::current_exception();
+          ctx.stop();
+        }
+      });
+  }
+
+  /// The threads return once the outstanding work is done.
+  void stop() {
+    work_guard.reset();
+  }
+
+  /// The threads return after their current handler. Outstanding work is not run.
+  void stop_now() {
+    work_guard.reset();
+    ctx.stop();
+  }
+
+  /// Waits for the threads to return.
+  void join() {
+    for (auto &thread: threads)
+      thread.join();
+    threads.clear();
+    std::lock_guard lock{mutex};
+    if (failure != nullptr)
+      std::rethrow_exception(std::exchange(failure, nullptr));
+  }
+
+  size_t thread_count() const {
+    return strands.size();
+  }
+
+  asio::io_context::executor_type get_executor() const {
+    return ctx.get_executor();
+  }
+
+  /// @return The strand of client `client`. Clients are spread round-robin over the strands.
+  strand_type strand(size_t client) const {
+    return strands[client % strands.size()];
+  }
+};
+
+#endif //CUSTOMASIOSTREAMS_CONTEXTRUNNER_H
@@ -0,0 +1,150 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_COWSTRING_H
+#define CUSTOMASIOSTREAMS_COWSTRING_H
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+/**
+ * A string whose contents can be handed out as immutable snapshots without copying them.
+ *
+ * A snapshot shares the storage. The first mutation after a snapshot was taken switches to a fresh buffer,
+ * copying only what the mutation keeps. So snapshots never see changes and never block the owner.
+ *
+ * Not thread safe, like `std::string`. Snapshots may be read and released on any thread.
+ * Whether the buffer is shared is tracked by the owner, not read from the reference count:
+ * a count that just dropped to one doesn't order the reads of the releasing thread before our mutation.
+ */
+class CowString {
+  std::shared_ptr<std::string> data = std::make_shared<std::string>();
+  /// Set by `snapshot()`, cleared when the next mutation switches to a fresh buffer.
+  mutable bool shared = false;
+
+  void replace(std::shared_ptr<std::string> fresh) {
+    data = std::move(fresh);
+    shared = false;
+  }
+
+  std::string &unshared() {
+    if (shared)
+      replace(std::make_shared<std::string>(*data));
+    return *data;
+  }
+
+public:
+  using Snapshot = std::shared_ptr<const std::string>;
+
+  CowString() = default;
+  CowString(CowString &&) noexcept = default;
+  CowString &operator=(CowString &&) noexcept = default;
+
+  // A copy would share the buffer without the other side knowing.
+  CowString(const CowString &) = delete;
+  CowString &operator=(const CowString &) = delete;
+
+  /// @return The current contents. They stay unchanged for as long as the snapshot is held.
+  Snapshot snapshot() const {
+    shared = true;
+    return data;
+  }
+
+  std::string_view view() const {
+    return *data;
+  }
+
+  size_t size() const {
+    return data->size();
+  }
+
+  bool empty() const {
+    return data->empty();
+  }
+
+  char at(size_t pos) const {
+    return data->at(pos);
+  }
+
+  CowString &operator+=(std::string_view appended) {
+    unshared() += appended;
+    return *this;
+  }
+
+  /// Takes over the storage of `contents`. Use `assign` to keep the capacity of the own buffer.
+  CowString &operator=(std::string contents) {
+    if (shared)
+      replace(std::make_shared<std::string>(std::move(contents)));
+    else
+      *data = std::move(contents);
+    return *this;
+  }
+
+  /// Copies `contents` into the own buffer, which keeps its capacity unless it is shared.
+  void assign(std::string_view contents) {
+    if (shared)
+      replace(std::make_shared<std::string>(contents));
+    else
+      data->assign(contents);
+  }
+
+  /// Keeps the capacity. A shared buffer is replaced by a fresh one of the same capacity.
+  void clear() {
+    if (shared) {
+      auto fresh = std::make_shared<std::string>();
+      fresh->reserve(data->capacity());
+      replace(std::move(fresh));
+    } else {
+      data->clear();
+    }
+  }
+
+  /// Removes `count` characters at `pos`. A shared buffer is replaced by a copy of what remains.
+  void erase(size_t pos, size_t count) {
+    if (!shared) {
+      data->erase(pos, count);
+      return;
+    }
+    auto remaining = std::make_shared<std::string>(data->substr(0, pos));
+    if (pos < data->size() && count < data->size() - pos)
+      remaining->append(*data, pos + count);
+    replace(std::move(remaining));
+  }
+
+  /// Grows the capacity to `capacity` and touches it, so that appending up to it neither allocates nor page faults.
+  void prefault(size_t capacity) {
+    auto &string = unshared();
+    auto size = string.size();
+    if (capacity > size) {
+      string.resize(capacity);
+      string.resize(size);
+    }
+  }
+
+  /**
+   * Moves the contents out, copying them only if a snapshot was taken since the last mutation.
+   * Leaves the string empty. It keeps its capacity, the storage is swapped with a replacement reserved to the same size.
+   */
+  std::string take() {
+    std::string contents;
+    if (shared) {
+      contents = *data;
+      clear();
+    } else {
+      contents.reserve(data->capacity());
+      contents.swap(*data);
+    }
+    return contents;
+  }
+
+  friend std::ostream &operator<<(std::ostream &stream, const CowString &string) {
+    return stream << string.view();
+  }
+};
+
+#endif //CUSTOMASIOSTREAMS_COWSTRING_H
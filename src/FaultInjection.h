@@ -0,0 +1,155 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_FAULTINJECTION_H
+#define CUSTOMASIOSTREAMS_FAULTINJECTION_H
+
+#include "Helpers.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <random>
+#include <type_traits>
+#include <variant>
+
+/**
+ * Latency and fault injection for the stream ops of a service.
+ * Lets retry, timeout and backpressure logic be measured under realistic tail latency without a real backend.
+ */
+namespace FaultInjection {
+  using duration = std::chrono::steady_clock::duration;
+
+  struct no_latency {
+  };
+
+  struct fixed_latency {
+    duration latency;
+  };
+
+  /// A long tailed distribution, typical for network round trips. A median that is not positive means no latency.
+  struct lognormal_latency {
+    duration median;
+    /// The standard deviation of the logarithm. 0.5 gives a p99 of about three times the median.
+    double sigma = 0.5;
+  };
+
+  /// Mostly fast, sometimes slow. Like a cache in front of a slow backend.
+  struct bimodal_latency {
+    duration fast;
+    duration slow;
+    double slow_probability = 0.05;
+  };
+
+  using LatencyDistribution = std::variant<no_latency, fixed_latency, lognormal_latency, bimodal_latency>;
+
+  struct FaultProfile {
+    LatencyDistribution latency;
+    /// Ops that fail with `bad_descriptor` after their latency.
+    double error_probability = 0;
+    /// Reads that deliver only a part of the available data.
+    double partial_read_probability = 0;
+    /// Ops that stall the whole service for `stall_duration`. Every op started during a stall waits until it is over.
+    double stall_probability = 0;
+    duration stall_duration = std::chrono::milliseconds(100);
+    uint64_t seed = 0;
+  };
+
+  /// What happens to one op.
+  struct Fault {
+    /// Waited before the op is performed.
+    duration delay{};
+    boost::system::error_code error;
+    /// Reads deliver at most this fraction of the available data, but at least one byte.
+    double read_fraction = 1;
+  };
+
+  struct Stats {
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    uint64_t partial_reads = 0;
+    uint64_t stalls = 0;
+  };
+
+  /// Draws the faults of the ops of one service. Thread safe.
+  class FaultInjector {
+    const FaultProfile profile;
+    std::mutex mutex;
+    std::mt19937_64 rng;
+    std::chrono::steady_clock::time_point stalled_until{};
+    Stats stats_;
+
+    bool chance(double probability) {
+      return probability > 0 && std::uniform_real_distribution<double>{0, 1}(rng) < probability;
+    }
+
+    /**
+     * The logarithm of a median that is not positive is not finite and would make every delay NaN or infinite.
+     * Such a distribution injects no latency. A sigma that is not positive degenerates to the median.
+     */
+    static FaultProfile validated(FaultProfile profile) {
+      if (auto *lognormal = std::get_if<lognormal_latency>(&profile.latency)) {
+        if (lognormal->median <= duration::zero()) {
+          CAS_LOG(warn, "Faults") << "W: Lognormal latency with a median <= 0, no latency is injected" << std::endl;
+          profile.latency = no_latency{};
+        } else if (!(lognormal->sigma > 0)) {
+          profile.latency = fixed_latency{lognormal->median};
+        }
+      }
+      return profile;
+    }
+
+    duration sample_latency() {
+      return std::visit([this](const auto &distribution) -> duration {
+        using Distribution = std::decay_t<decltype(distribution)>;
+        if constexpr (std::is_same_v<Distribution, fixed_latency>) {
+          return distribution.latency;
+        } else if constexpr (std::is_same_v<Distribution, lognormal_latency>) {
+          auto median = static_cast<double>(distribution.median.count());
+          return duration{static_cast<duration::rep>(
+            std::lognormal_distribution<double>{std::log(median), distribution.sigma}(rng))};
+        } else if constexpr (std::is_same_v<Distribution, bimodal_latency>) {
+          return chance(distribution.slow_probability) ? distribution.slow : distribution.fast;
+        } else {
+          return duration{};
+        }
+      }, profile.latency);
+    }
+
+  public:
+    explicit FaultInjector(FaultProfile profile) : profile{validated(profile)}, rng{profile.seed} {}
+
+    /// Draws the fault of an op that starts now.
+    Fault next(bool is_read) {
+      std::lock_guard lock{mutex};
+      auto now = std::chrono::steady_clock::now();
+      stats_.ops++;
+      if (chance(profile.stall_probability)) {
+        stats_.stalls++;
+        stalled_until = std::max(stalled_until, now + profile.stall_duration);
+      }
+
+      Fault fault;
+      fault.delay = std::max(sample_latency(), stalled_until - now);
+      if (chance(profile.error_probability)) {
+        stats_.errors++;
+        fault.error = asio::error::bad_descriptor;
+      } else if (is_read && chance(profile.partial_read_probability)) {
+        stats_.partial_reads++;
+        fault.read_fraction = std::uniform_real_distribution<double>{0, 1}(rng);
+      }
+      return fault;
+    }
+
+    Stats stats() {
+      std::lock_guard lock{mutex};
+      return stats_;
+    }
+  };
+}
+
+#endif //CUSTOMASIOSTREAMS_FAULTINJECTION_H
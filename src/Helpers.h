@@ -7,7 +7,9 @@ You should have received a copy of the GNU General Public License along with thi
 #ifndef CUSTOMASIOSTREAMS_HELPERS_H
 #define CUSTOMASIOSTREAMS_HELPERS_H
 
+#include <initializer_list>
 #include <iostream>
+#include <string_view>
 #include <syncstream>
 #include <thread>
 #include <boost/asio.hpp>
@@ -15,10 +17,26 @@ You should have received a copy of the GNU General Public License along with thi
 
 #include <fmt/format.h>
 
-inline std::osyncstream tout(const std::string & tag = "") {
-  auto hash = std::hash<std::thread::id>{}(std::this_thread::get_id());
-  auto hashStr = fmt::format("T{:04X} ", hash >> (sizeof(hash) - 2) * 8); // only display 2 bytes
-  auto stream = std::osyncstream(std::cout);
+#include "AllocTracker.h"
+
+#ifdef CAS_ALLOC_TRACKING
+/// The buffer of the stream is filled after `tout` returned. The allocator attributes it to logging anyway.
+using tout_stream = std::basic_osyncstream<char, std::char_traits<char>,
+  AllocTracker::tagged_allocator<char, AllocTracker::Tag::logging>>;
+#else
+using tout_stream = std::osyncstream;
+#endif
+
+/// The prefix `tout` puts in front of the lines of a thread.
+inline std::string thread_prefix(std::thread::id id = std::this_thread::get_id()) {
+  auto hash = std::hash<std::thread::id>{}(id);
+  return fmt::format("T{:04X} ", hash >> (sizeof(hash) - 2) * 8); // only display 2 bytes
+}
+
+inline tout_stream tout(const std::string & tag = "") {
+  CAS_ALLOC_SCOPE(logging);
+  auto hashStr = thread_prefix();
+  auto stream = tout_stream(std::cout);
 
   stream << hashStr;
   if (not tag.empty())
@@ -26,6 +44,59 @@ inline std::osyncstream tout(const std::string & tag = "") {
   return stream;
 }
 
+/// The severity of a log statement in the library code.
+enum class log_level {
+  /// Per operation messages in the hot paths.
+  trace,
+  debug,
+  info,
+  warn,
+  error,
+  off
+};
+
+/**
+ * The lowest level that is compiled in. Set it with `-DCAS_LOG_LEVEL=<level>` or the CMake option of the same name.
+ * Defaults to `info` in builds with `NDEBUG` and to `trace` otherwise.
+ */
+#ifndef CAS_LOG_LEVEL
+#ifdef NDEBUG
+#define CAS_LOG_LEVEL info
+#else
+#define CAS_LOG_LEVEL trace
+#endif
+#endif
+
+/// Comma separated string literals. Statements with one of these tags are not compiled in.
+#ifndef CAS_LOG_DISABLED_TAGS
+#define CAS_LOG_DISABLED_TAGS
+#endif
+
+namespace log_filter {
+  inline constexpr log_level min_level = log_level::CAS_LOG_LEVEL;
+
+  constexpr bool tag_enabled(std::string_view tag) {
+    for (std::string_view disabled: std::initializer_list<std::string_view>{CAS_LOG_DISABLED_TAGS})
+      if (disabled == tag)
+        return false;
+    return true;
+  }
+
+  constexpr bool enabled(log_level level, std::string_view tag) {
+    return level != log_level::off && level >= min_level && tag_enabled(tag);
+  }
+}
+
+/**
+ * `tout(tag)` filtered at compile time. `tag` must be a constant expression.
+ * A filtered statement is discarded by `if constexpr`, so the streamed arguments are never evaluated.
+ *
+ * Usage: `CAS_LOG(trace, TAG) << "moving " << chunk.size() << " bytes" << std::endl;`
+ * It expands to an if-else, so brace it when it is the body of an if (-Wdangling-else).
+ */
+#define CAS_LOG(level, tag) \
+  if constexpr (!log_filter::enabled(log_level::level, tag)) {} else tout(tag)
+
 namespace asio = boost::asio;
 
 constexpr auto use_nothrow_awaitable = asio::experimental::as_tuple(asio::use_awaitable);
@@ -0,0 +1,149 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_IMMEDIATECOMPLETION_H
+#define CUSTOMASIOSTREAMS_IMMEDIATECOMPLETION_H
+
+#include "Helpers.h"
+
+#include <type_traits>
+#include <utility>
+
+/**
+ * Opt-in inline completion for ops whose result is known when they are initiated.
+ *
+ * By default an op never invokes its handler from within the initiating call, it posts the completion instead.
+ * A caller that wraps its token with `allow_immediate(token)` accepts that the handler runs inline.
+ * Only completions from within the initiating call (`complete_at_initiation`) run inline,
+ * `complete_from` always posts so that the handler never runs inside a handler of a foreign executor.
+ *
+ * A handler that initiates the next op could recurse without bound.
+ * So inline completions are counted per thread and beyond `MAX_IMMEDIATE_DEPTH` the completion is posted again,
+ * which unwinds the stack (trampolining).
+ */
+namespace immediate_completion {
+  /// The deepest nesting of inline completions on one thread.
+  static const constexpr size_t MAX_IMMEDIATE_DEPTH = 16;
+
+  /// The current nesting of inline completions on this thread.
+  inline thread_local size_t depth = 0;
+
+  template<typename Token>
+  struct allow_immediate_t {
+    Token token;
+  };
+
+  /// Wraps the handler of an op that was initiated with `allow_immediate`.
+  template<typename Handler>
+  struct immediate_handler {
+    Handler handler;
+
+    template<typename... Args>
+    void operator()(Args &&... args) {
+      std::move(handler)(std::forward<Args>(args)...);
+    }
+  };
+
+  template<typename Handler>
+  struct is_immediate : std::false_type {
+  };
+
+  template<typename Handler>
+  struct is_immediate<immediate_handler<Handler>> : std::true_type {
+  };
+
+  /// Counts an inline completion for as long as it runs.
+  class depth_guard {
+  public:
+    depth_guard() {
+      depth++;
+    }
+
+    ~depth_guard() {
+      depth--;
+    }
+
+    depth_guard(const depth_guard &) = delete;
+    depth_guard &operator=(const depth_guard &) = delete;
+  };
+
+  /// @return If `Handler` opted in and the thread may nest one more inline completion.
+  template<typename Handler>
+  bool may_complete_inline() {
+    return is_immediate<std::decay_t<Handler>>::value && depth < MAX_IMMEDIATE_DEPTH;
+  }
+}
+
+/// Lets the op complete inline if its result is known at initiation. See `immediate_completion`.
+template<typename Token>
+immediate_completion::allow_immediate_t<std::decay_t<Token>> allow_immediate(Token &&token) {
+  return {std::forward<Token>(token)};
+}
+
+/**
+ * Completes an op from within its initiating function.
+ * A handler that opted in is invoked inline, all others are posted to `executor`.
+ */
+template<typename Executor, typename Handler, typename... Args>
+void complete_at_initiation(const Executor &executor, Handler &&handler, Args... args) {
+  if (immediate_completion::may_complete_inline<Handler>()) {
+    immediate_completion::depth_guard guard;
+    std::forward<Handler>(handler)(std::move(args)...);
+    return;
+  }
+  asio::post(executor, [handler = std::forward<Handler>(handler), args...]() mutable {
+    std::move(handler)(std::move(args)...);
+  });
+}
+
+/**
+ * Completes an op from a foreign executor, e.g. the service strand.
+ * Always posts to `executor`, also for handlers that opted in.
+ * Dispatching would run the handler inside the handler of the foreign executor (and on a strand, while holding it)
+ * whenever its thread also runs `executor`.
+ */
+template<typename Executor, typename Handler, typename... Args>
+void complete_from(const Executor &executor, Handler &&handler, Args... args) {
+  asio::post(executor, [handler = std::forward<Handler>(handler), args...]() mutable {
+    std::move(handler)(std::move(args)...);
+  });
+}
+
+namespace boost::asio {
+  template<typename Token, typename Signature>
+  struct async_result<immediate_completion::allow_immediate_t<Token>, Signature> {
+    template<typename Initiation, typename RawToken, typename... Args>
+    static auto initiate(Initiation &&initiation, RawToken &&token, Args &&... args) {
+      return asio::async_initiate<Token, Signature>(
+        [initiation = std::forward<Initiation>(initiation)](auto &&handler, auto &&... args) mutable {
+          std::move(initiation)(immediate_completion::immediate_handler<std::decay_t<decltype(handler)>>{
+            std::forward<decltype(handler)>(handler)}, std::forward<decltype(args)>(args)...);
+        }, token.token, std::forward<Args>(args)...);
+    }
+  };
+
+  template<typename Handler, typename Executor>
+  struct associated_executor<immediate_completion::immediate_handler<Handler>, Executor> {
+    typedef typename associated_executor<Handler, Executor>::type type;
+
+    static type get(const immediate_completion::immediate_handler<Handler> &handler,
+                    const Executor &executor = Executor()) noexcept {
+      return associated_executor<Handler, Executor>::get(handler.handler, executor);
+    }
+  };
+
+  template<typename Handler, typename Allocator>
+  struct associated_allocator<immediate_completion::immediate_handler<Handler>, Allocator> {
+    typedef typename associated_allocator<Handler, Allocator>::type type;
+
+    static type get(const immediate_completion::immediate_handler<Handler> &handler,
+                    const Allocator &allocator = Allocator()) noexcept {
+      return associated_allocator<Handler, Allocator>::get(handler.handler, allocator);
+    }
+  };
+}
+
+#endif //CUSTOMASIOSTREAMS_IMMEDIATECOMPLETION_H
@@ -0,0 +1,333 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_MEMORYGOVERNOR_H
+#define CUSTOMASIOSTREAMS_MEMORYGOVERNOR_H
+
+#include "Helpers.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A process wide memory budget shared by all services.
+ *
+ * Every service registers an account with a weight.
+ * The share of an account is the budget split by weight.
+ * Charges succeed while the total stays within the budget.
+ * When they don't, `async_charge` waits (backpressure) until other accounts release memory.
+ * Waiters are granted in order of the lowest usage per weight.
+ * While others are waiting an account can't charge beyond its share, so one bursting service can't starve the rest.
+ *
+ * Thread safe. Completions are posted to the associated executor of the handler.
+ */
+class MemoryGovernor {
+public:
+  class Account;
+
+  /// Usage of one account.
+  struct Usage {
+    std::string name;
+    double weight;
+    size_t bytes;
+    size_t share;
+    /// Bytes requested by the pending `async_charge` calls.
+    size_t waiting;
+  };
+
+private:
+  struct Waiter {
+    Account *account;
+    size_t bytes;
+
+    Waiter(Account *account, size_t bytes) : account{account}, bytes{bytes} {}
+    virtual ~Waiter() = default;
+
+    /// Posts the completion. Must be called without holding the mutex.
+    virtual void complete(boost::system::error_code ec) = 0;
+  };
+
+  template<typename Handler, typename WorkGuard>
+  struct WaiterOp final : Waiter {
+    Handler handler;
+    WorkGuard workGuard;
+
+    WaiterOp(Account *account, size_t bytes, Handler &&handler, WorkGuard &&workGuard)
+      : Waiter{account, bytes}, handler{std::move(handler)}, workGuard{std::move(workGuard)} {}
+
+    void complete(boost::system::error_code ec) override {
+      asio::post(workGuard.get_executor(), [handler = std::move(handler), ec]() mutable {
+        std::move(handler)(ec);
+      });
+    }
+  };
+
+  mutable std::mutex mutex;
+  size_t budget = std::numeric_limits<size_t>::max();
+  size_t used = 0;
+  std::vector<Account *> accounts;
+  /// In arrival order.
+  std::vector<std::unique_ptr<Waiter>> waiters;
+
+  MemoryGovernor() = default;
+
+  // The functions below must be called with the mutex held.
+
+  size_t share_of(const Account &account) const;
+
+  bool may_charge(const Account &account, size_t bytes) const;
+
+  /// Moves the waiters that can be granted now into `granted`.
+  void grant_waiters(std::vector<std::unique_ptr<Waiter>> &granted);
+
+  static void complete_all(std::vector<std::unique_ptr<Waiter>> &waiters, boost::system::error_code ec) {
+    for (auto &waiter: waiters)
+      waiter->complete(ec);
+  }
+
+public:
+  MemoryGovernor(const MemoryGovernor &) = delete;
+  MemoryGovernor &operator=(const MemoryGovernor &) = delete;
+
+  /// @return The governor of this process.
+  static MemoryGovernor &instance() {
+    static MemoryGovernor governor;
+    return governor;
+  }
+
+  /// Sets the total number of bytes all accounts may use. Unlimited by default.
+  void set_budget(size_t bytes) {
+    std::vector<std::unique_ptr<Waiter>> granted;
+    {
+      std::lock_guard lock{mutex};
+      budget = bytes;
+      grant_waiters(granted);
+    }
+    complete_all(granted, {});
+  }
+
+  /**
+   * Registers an account. It is unregistered when the returned pointer is destroyed.
+   * @param executor Used for completions if a handler has no associated executor.
+   */
+  std::shared_ptr<Account> register_account(std::string name, double weight, asio::any_io_executor executor);
+
+  /// @return The usage of every account.
+  std::vector<Usage> report() const;
+};
+
+/// The share of one service in the memory budget.
+class MemoryGovernor::Account {
+  friend MemoryGovernor;
+
+  MemoryGovernor &governor;
+  const std::string name;
+  const double weight;
+  const asio::any_io_executor executor;
+  /// Guarded by the mutex of the governor.
+  size_t bytes = 0;
+  /// Set by `cancel()`. Guarded by the mutex of the governor.
+  bool cancelled = false;
+
+  /// Aborts the pending charges, with `cancel` also the future ones.
+  void abort_pending(bool cancel) {
+    std::vector<std::unique_ptr<Waiter>> aborted, granted;
+    {
+      std::lock_guard lock{governor.mutex};
+      cancelled = cancelled || cancel;
+      aborted = take_waiters();
+      governor.grant_waiters(granted);
+    }
+    complete_all(aborted, asio::error::operation_aborted);
+    complete_all(granted, {});
+  }
+
+  /// Removes the pending charges of this account from the governor. Must be called with the mutex held.
+  std::vector<std::unique_ptr<Waiter>> take_waiters() {
+    std::vector<std::unique_ptr<Waiter>> taken;
+    for (auto it = governor.waiters.begin(); it != governor.waiters.end();) {
+      if ((*it)->account == this) {
+        taken.push_back(std::move(*it));
+        it = governor.waiters.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    return taken;
+  }
+
+public:
+  Account(MemoryGovernor &governor, std::string name, double weight, asio::any_io_executor executor)
+    : governor{governor}, name{std::move(name)}, weight{std::max(weight, 0.001)}, executor{std::move(executor)} {}
+
+  Account(const Account &) = delete;
+  Account &operator=(const Account &) = delete;
+
+  /// Returns the charged bytes and aborts the pending charges.
+  ~Account() {
+    std::vector<std::unique_ptr<Waiter>> aborted, granted;
+    {
+      std::lock_guard lock{governor.mutex};
+      std::erase(governor.accounts, this);
+      governor.used -= bytes;
+      aborted = take_waiters();
+      governor.grant_waiters(granted);
+    }
+    complete_all(aborted, asio::error::operation_aborted);
+    complete_all(granted, {});
+  }
+
+  /**
+   * Aborts the pending `async_charge` calls with `operation_aborted`. Later calls are not affected.
+   * Used when the owner goes away so that nothing waits for memory that may never be released.
+   */
+  void abort_waiters() {
+    abort_pending(false);
+  }
+
+  /**
+   * Aborts the pending and all future `async_charge` calls with `operation_aborted`.
+   * Used when the owner shuts down.
+   */
+  void cancel() {
+    abort_pending(true);
+  }
+
+  /// @return The bytes currently charged to this account.
+  size_t charged() const {
+    std::lock_guard lock{governor.mutex};
+    return bytes;
+  }
+
+  /**
+   * Charges the bytes if the budget allows it.
+   * Cheaper than `async_charge`, so callers try this first and only wait if it fails.
+   */
+  bool try_charge(size_t n) {
+    std::lock_guard lock{governor.mutex};
+    if (cancelled || !governor.may_charge(*this, n))
+      return false;
+    governor.used += n;
+    bytes += n;
+    return true;
+  }
+
+  /// Charges memory that is already in use. This may exceed the budget.
+  void force_charge(size_t n) {
+    std::lock_guard lock{governor.mutex};
+    governor.used += n;
+    bytes += n;
+  }
+
+  /// Returns memory to the budget and wakes up waiters.
+  void release(size_t n) {
+    std::vector<std::unique_ptr<Waiter>> granted;
+    {
+      std::lock_guard lock{governor.mutex};
+      n = std::min(n, bytes);
+      governor.used -= n;
+      bytes -= n;
+      governor.grant_waiters(granted);
+    }
+    complete_all(granted, {});
+  }
+
+  typedef void async_charge_handler(boost::system::error_code);
+
+  /**
+   * Charges the bytes as soon as the budget allows it.
+   * Completes with `no_memory` if the request is larger than the whole budget
+   * and with `operation_aborted` if the account is cancelled or destroyed first.
+   */
+  template<asio::completion_token_for<async_charge_handler> CompletionToken>
+  auto async_charge(size_t n, CompletionToken &&token) {
+    return asio::async_initiate<CompletionToken, async_charge_handler>(
+      [this, n](auto completion_handler) {
+        auto comp_executor = asio::get_associated_executor(completion_handler, executor);
+        auto waiter = std::make_unique<WaiterOp<decltype(completion_handler), decltype(asio::make_work_guard(comp_executor))>>(
+          this, n, std::move(completion_handler), asio::make_work_guard(comp_executor));
+
+        boost::system::error_code ec;
+        {
+          std::lock_guard lock{governor.mutex};
+          if (cancelled) {
+            ec = asio::error::operation_aborted;
+          } else if (n > governor.budget) {
+            ec = asio::error::no_memory;
+          } else if (governor.may_charge(*this, n)) {
+            governor.used += n;
+            bytes += n;
+          } else {
+            governor.waiters.push_back(std::move(waiter));
+            return;
+          }
+        }
+        waiter->complete(ec);
+      }, token);
+  }
+};
+
+inline size_t MemoryGovernor::share_of(const Account &account) const {
+  double total_weight = 0;
+  for (auto *other: accounts)
+    total_weight += other->weight;
+  return static_cast<size_t>(static_cast<double>(budget) * (account.weight / total_weight));
+}
+
+inline bool MemoryGovernor::may_charge(const Account &account, size_t bytes) const {
+  if (bytes > budget - std::min(used, budget))
+    return false;
+  // While others wait, stay within the own share.
+  return waiters.empty() || account.bytes + bytes <= share_of(account);
+}
+
+inline void MemoryGovernor::grant_waiters(std::vector<std::unique_ptr<Waiter>> &granted) {
+  while (!waiters.empty()) {
+    auto best = waiters.end();
+    for (auto it = waiters.begin(); it != waiters.end(); ++it) {
+      if ((*it)->bytes > budget - std::min(used, budget))
+        continue;
+      auto ratio = static_cast<double>((*it)->account->bytes) / (*it)->account->weight;
+      if (best == waiters.end() ||
+          ratio < static_cast<double>((*best)->account->bytes) / (*best)->account->weight)
+        best = it;
+    }
+    if (best == waiters.end())
+      return;
+
+    used += (*best)->bytes;
+    (*best)->account->bytes += (*best)->bytes;
+    granted.push_back(std::move(*best));
+    waiters.erase(best);
+  }
+}
+
+inline std::shared_ptr<MemoryGovernor::Account>
+MemoryGovernor::register_account(std::string name, double weight, asio::any_io_executor executor) {
+  auto account = std::make_shared<Account>(*this, std::move(name), weight, std::move(executor));
+  std::lock_guard lock{mutex};
+  accounts.push_back(account.get());
+  return account;
+}
+
+inline std::vector<MemoryGovernor::Usage> MemoryGovernor::report() const {
+  std::lock_guard lock{mutex};
+  std::vector<Usage> usages;
+  for (auto *account: accounts) {
+    size_t waiting = 0;
+    for (auto &waiter: waiters)
+      if (waiter->account == account)
+        waiting += waiter->bytes;
+    usages.push_back(Usage{account->name, account->weight, account->bytes, share_of(*account), waiting});
+  }
+  return usages;
+}
+
+#endif //CUSTOMASIOSTREAMS_MEMORYGOVERNOR_H
@@ -0,0 +1,2014 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_MODERNIOSERVICE_H
+#define CUSTOMASIOSTREAMS_MODERNIOSERVICE_H
+
+// Horizontal striped ╍
+
+/*
+ * Overview:
+ *
+ *            ┌──────────────────────────────────┬──────────────────────────────────────────────────────┐
+ *            │                                  ┊                                                      │
+ *            │ ModernIOServiceImpl (IOService)  ┊  Life time                                           │
+ *            │                                  ┊  Is kept alive by the IOSrvWrapper                   │
+ *            │ Produces/Consumes data           ┊  Can keep itself alive (shared_from_this)            │
+ *            │ Does work                        ┊  Is kept alive by async functions for their duration │
+ *            │                                  ┊                                                      │
+ *            │ Manages threading internally     ┊                                                      │
+ *            │                                  ┊                                                      │
+ *            └──────────────────────────────────┴──────────────────────────────────────────────────────┘
+ *               ▲            ▲
+ *               │            │
+ * Service       │            │Owns/Creates
+ * Executor   ┌──┼────────────┴──────────────────┐
+ * ───────────┼──┘                               │
+ * And other  │ ModernIOService (IOSrvWrapper)   │
+ * args       │ 1 Instance per running Service   │
+ *            │                                  │
+ *            │ Instantiates the impl            │
+ *            │ Provides access to io objects    │
+ *            │                                  │
+ *            │ Thread safe                      │
+ *            │                                  │
+ *            └───────────────┬──────────────────┘
+ *                            │Creates
+ *                            │for every concurrent user
+ * Caller                     ▼
+ * Executor   ┌──────────────────────────────────┐
+ * ──────────►│                                  │
+ *            │ ModernIOServiceClient (IOObject) │
+ *            │ Behaves like a file descriptor   │
+ *            │                                  │
+ *            │ Accesses async functions         │
+ *            │                                  │
+ *            │ Single thread only               │
+ *            │                                  │
+ *            └───────────────┬──────────────────┘
+ *                            │Creates
+ *                            │Passes Caller Executor             ...
+ *                            ├────────────────────────┬────────────►
+ *                            │                        │
+ *                            ▼                        ▼
+ *            ┌──────────────────────────┐ ┌──────────────────────────┐
+ *            │                          │ │                          │
+ *            │ AsyncStream (IOObject)   │ │ Other sub io object      │
+ *            │ Like a file descriptor   │ │ Like a file descriptor   │
+ *            │                          │ │                          │
+ *            │ Accesses async functions │ │ Accesses async functions │
+ *            │ Can keep internal state  │ │ Can keep internal state  │
+ *            │ eg: start, end, pos      │ │                          │
+ *            │                          │ │                          │
+ *            │ Single thread only       │ │ Single thread only       │
+ *            │                          │ │                          │
+ *            └──────────────────────────┘ └──────────────────────────┘
+ */
+
+#include "BinaryLogger.h"
+#include "ConcurrencyLimiter.h"
+#include "CowString.h"
+#include "FaultInjection.h"
+#include "Helpers.h"
+#include "ImmediateCompletion.h"
+#include "MemoryGovernor.h"
+#include "SegmentedLog.h"
+
+#include <boost/asio/experimental/awaitable_operators.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <coroutine>
+#include <deque>
+#include <future>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <memory>
+#include <vector>
+
+namespace ModernIOService {
+  /**
+   * Keeps the memory of a long-running service bounded.
+   * The log policies are applied incrementally on the service strand.
+   */
+  struct RetentionPolicy {
+    /// Log segments whose newest record is older than this are removed. Zero disables it.
+    std::chrono::milliseconds max_age{0};
+    /// The oldest log segments are removed while a partition is larger than this. Zero disables it.
+    size_t max_bytes = 0;
+    /// Only the newest record of every key is kept in sealed log segments. Disabled when empty.
+    SegmentedLog::KeyFunction key_of;
+    /// The oldest unread data is dropped while `buffer_out` is larger than this. Zero disables it.
+    size_t max_buffer_out_bytes = 0;
+    /// How often the log policies are applied.
+    std::chrono::milliseconds interval{1000};
+    /// The longest time the compaction may occupy the strand before it lets pending ops run.
+    std::chrono::microseconds slice_budget{200};
+
+    bool applies_to_log() const {
+      return max_age.count() != 0 || max_bytes != 0 || key_of;
+    }
+  };
+
+  /// When the service generates its output.
+  enum class production_mode {
+    /// The main loop produces a chunk every tick, whether or not anyone reads it.
+    eager,
+    /// Reads that find no buffered data trigger the production. The data is generated straight into the reader's buffer
+    /// and sized to it. Nothing is produced for idle streams and no intermediate buffer is involved.
+    on_demand
+  };
+
+  /// Options of a service instance.
+  struct ModernIOServiceOptions {
+    /// Keeps all produced data in a segmented log so that it can be read again by offset.
+    bool retain_log = false;
+    /// The size at which the log starts a new segment.
+    size_t log_segment_bytes = 4096;
+    /// The output is spread round-robin over this many log partitions. Each partition is read by one member of a consumer group.
+    size_t log_partitions = 1;
+    RetentionPolicy retention;
+    /// The name the service is reported with by the `MemoryGovernor`.
+    std::string name = "ModernIOService";
+    /// The share of the process wide memory budget relative to the other services.
+    double memory_weight = 1;
+    /// Bounds the running read and write ops of all `MyAsyncStream`s of the service. Zero means unlimited.
+    size_t max_concurrent_ops = 0;
+    /// What happens to ops beyond `max_concurrent_ops`.
+    saturation_policy ops_saturation_policy = saturation_policy::queue;
+    /// Injects latency, errors and stalls into the read and write ops of the non-pipelined `MyAsyncStream`s.
+    std::optional<FaultInjection::FaultProfile> faults;
+    production_mode production = production_mode::eager;
+  };
+
+  namespace detail {
+    // region parked reads
+
+    /**
+     * A read that waits on the service strand until data is available.
+     * The handler type is erased so that the reads of different callers can share one queue.
+     */
+    class ParkedRead {
+    public:
+      /// Only the first non-empty buffer of the sequence is used. Which is allowed for `async_read_some`.
+      asio::mutable_buffer buffer;
+      /// The executor the handler is invoked on.
+      asio::any_io_executor executor;
+
+      ParkedRead(asio::mutable_buffer buffer, asio::any_io_executor executor) : buffer{buffer},
+                                                                               executor{std::move(executor)} {}
+      virtual ~ParkedRead() = default;
+
+      /// Invokes the handler in place. Must be called once, on `executor`.
+      virtual void invoke(boost::system::error_code ec, size_t n) = 0;
+    };
+
+    template<typename Handler, typename WorkGuard>
+    class ParkedReadOp final : public ParkedRead {
+      Handler handler;
+      /// Keeps the caller executor alive while the read is parked.
+      WorkGuard workGuard;
+    public:
+      ParkedReadOp(asio::mutable_buffer buffer, Handler &&handler, WorkGuard &&workGuard)
+        : ParkedRead{buffer, workGuard.get_executor()}, handler{std::move(handler)}, workGuard{std::move(workGuard)} {}
+
+      void invoke(boost::system::error_code ec, size_t n) override {
+        std::move(handler)(ec, n);
+      }
+    };
+
+    /**
+     * Collects the completions of the parked reads that are served at once, e.g. when a big chunk arrives.
+     * `post()` delivers them with one post per caller executor. The handlers of a group run in sequence, in the order they were added.
+     */
+    class CompletionBatch {
+      struct Completion {
+        std::unique_ptr<ParkedRead> read;
+        boost::system::error_code ec;
+        size_t n;
+      };
+
+      std::vector<std::pair<asio::any_io_executor, std::vector<Completion>>> groups;
+    public:
+      void add(std::unique_ptr<ParkedRead> read, boost::system::error_code ec, size_t n) {
+        auto group = std::find_if(groups.begin(), groups.end(), [&](auto &group) {
+          return group.first == read->executor;
+        });
+        if (group == groups.end())
+          group = groups.emplace(groups.end(), read->executor, std::vector<Completion>{});
+        group->second.push_back({std::move(read), ec, n});
+      }
+
+      /// The work guards of the reads keep the executors alive until their handlers ran.
+      void post() {
+        for (auto &[executor, completions]: groups)
+          asio::post(executor, [completions = std::move(completions)]() mutable {
+            for (auto &completion: completions)
+              completion.read->invoke(completion.ec, completion.n);
+          });
+        groups.clear();
+      }
+    };
+
+    /// The queue of a pipelined stream. The reads are served in issue order.
+    struct ReadPipeline {
+      /// Reads beyond this limit fail with `try_again`.
+      const size_t max_outstanding;
+      /// Incremented by the stream and decremented by the service strand.
+      std::atomic<size_t> outstanding{0};
+      /// Only accessed on the service strand.
+      std::deque<std::unique_ptr<ParkedRead>> reads;
+
+      explicit ReadPipeline(size_t max_outstanding) : max_outstanding{max_outstanding} {}
+    };
+
+    /// @return The first non-empty buffer of the sequence.
+    template<typename MutableBufferSequence>
+    asio::mutable_buffer first_buffer(const MutableBufferSequence &buffers) {
+      for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers); ++it) {
+        asio::mutable_buffer buffer(*it);
+        if (buffer.size() != 0)
+          return buffer;
+      }
+      return {};
+    }
+
+    // endregion
+
+    /**
+     * Guards state that is owned by a strand against occasional access from other threads.
+     *
+     * Until `share()` ran on the strand, `lock()` and `unlock()` do nothing, so the strand pays no lock for as long as
+     * no other thread needs the state. From then on it is a plain mutex.
+     * The strand must not hold it across a `co_await`, so `share()` can't run between a `lock()` and its `unlock()`.
+     * Other threads only use `try_lock()`, which fails until the state is shared.
+     */
+    class StrandMutex {
+      std::mutex mutex;
+      std::atomic<bool> shared{false};
+      std::atomic<bool> share_requested{false};
+    public:
+      void lock() {
+        if (shared.load(std::memory_order_relaxed)) // only changes on the strand
+          mutex.lock();
+      }
+
+      void unlock() {
+        if (shared.load(std::memory_order_relaxed))
+          mutex.unlock();
+      }
+
+      bool try_lock() {
+        return shared.load(std::memory_order_acquire) && mutex.try_lock();
+      }
+
+      /// Starts locking. Must be called on the strand.
+      void share() {
+        shared.store(true, std::memory_order_release);
+      }
+
+      /// @return True for the first call only, so that `share()` is requested once.
+      bool request_share() {
+        return !shared.load(std::memory_order_acquire) && !share_requested.exchange(true);
+      }
+    };
+
+    /**
+     * State of a named consumer group. Only accessed on the service strand.
+     *
+     * Each partition is owned by exactly one member.
+     * On every join or leave the partitions are reassigned and the read positions are reset to the committed offsets.
+     * So data that was read but not committed by the previous owner is read again by the new owner.
+     */
+    struct ConsumerGroup {
+      /// Incremented on every rebalance.
+      uint64_t generation = 0;
+      /// Member ids in join order.
+      std::vector<uint64_t> members;
+      /// The member id that owns a partition. Zero if the group has no members.
+      std::vector<uint64_t> owners;
+      /// The offset of every partition up to which the data has been processed.
+      std::vector<uint64_t> committed;
+      /// The offset of every partition the owner reads next.
+      std::vector<uint64_t> positions;
+
+      explicit ConsumerGroup(size_t partitions) : owners(partitions), committed(partitions), positions(partitions) {}
+
+      void join(uint64_t member_id) {
+        members.push_back(member_id);
+        rebalance();
+      }
+
+      void leave(uint64_t member_id) {
+        std::erase(members, member_id);
+        rebalance();
+      }
+
+      bool owns(uint64_t member_id, size_t partition) const {
+        return owners[partition] == member_id;
+      }
+
+    private:
+      void rebalance() {
+        generation++;
+        for (size_t partition = 0; partition < owners.size(); partition++)
+          owners[partition] = members.empty() ? 0 : members[partition % members.size()];
+        positions = committed;
+      }
+    };
+
+    template<typename Executor> requires my_is_executor<Executor>::value
+    class ModernIOServiceImpl : public std::enable_shared_from_this<ModernIOServiceImpl<Executor>> {
+    public: // make all members that need to be accessed by io objects public
+      /// Data sent to the service
+      std::string buffer_in;
+      /// Data produced by the service. Snapshots of it are handed out by `async_peek_snapshot` without copying.
+      CowString buffer_out;
+      /**
+       * Guards the buffers and `accounted_bytes` against the `try_` ops of the streams, which run on the caller's thread.
+       * Code on the strand holds it while it accesses them. It is never held across a `co_await`.
+       * It only locks once a `try_` op was used on the service, see `share_buffers()`.
+       */
+      StrandMutex buffers_mutex;
+      /// The size of `buffer_out` as of the last change. Lets `try_read_some` give up without taking the lock.
+      std::atomic<size_t> readable_bytes{0};
+      /// The strand used to avoid concurrent execution if the passed executor is backed by multiple threads.
+      asio::strand<Executor> strand;
+      const ModernIOServiceOptions options;
+      /// All produced data spread over the partitions if `options.retain_log` is set.
+      std::vector<SegmentedLog> logs;
+      /// Consumer groups by name.
+      std::map<std::string, ConsumerGroup, std::less<>> groups;
+      /// Used to hand out unique ids to consumer group members. Zero is never used.
+      uint64_t last_member_id = 0;
+      /// The account of this service in the process wide memory budget.
+      const std::shared_ptr<MemoryGovernor::Account> memory;
+      /// Only set if `options.max_concurrent_ops` is set. Outlives the service while ops hold a slot.
+      const std::shared_ptr<ConcurrencyLimiter> ops_limiter;
+      /// Only set if `options.faults` is set.
+      const std::unique_ptr<FaultInjection::FaultInjector> faults;
+      /// Set by `shutdown`. Writes are refused, reads drain what is left in `buffer_out`.
+      std::atomic<bool> closing{false};
+      /// Set by `async_shutdown`. The destructor expires it at `time_point::min()` to report that the impl is gone.
+      std::shared_ptr<asio::steady_timer> destroyed_signal;
+      /// The bytes of the buffers and logs that are charged to `memory`. Guarded by `buffers_mutex`.
+      size_t accounted_bytes = 0;
+    private:
+      /// Used to schedule the retention of the log.
+      asio::steady_timer compaction_timer;
+      /// Wakes up `shutdown` when `buffer_out` runs empty.
+      asio::steady_timer drain_timer;
+      /// Pipelines with parked reads in the order they became active.
+      std::deque<std::shared_ptr<ReadPipeline>> active_pipelines;
+      /// Set once the main loop is done. No more data will be produced.
+      bool done = false;
+      /// Counts the records produced on demand, used to spread them over the log partitions.
+      size_t produced_on_demand = 0;
+
+      /// Used to slow the data consumption and generation
+      asio::steady_timer timer;
+
+      /// Used to generate data
+      std::mt19937 gen;
+      /// https://stackoverflow.com/a/69753502/4479969
+      constexpr static const char charset[] =
+        "0123456789"
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+        "abcdefghijklmnopqrstuvwxyz";
+
+      /// Fills `length` chars at `out`. `std::sample` picks at most one char per charset entry, so longer runs take several draws.
+      template<typename URBG>
+      static void gen_into(char *out, std::size_t length, URBG &&g) {
+        const auto charset_size = std::size(charset) - 1; // without the terminator
+        while (length != 0) {
+          auto n = std::min(length, charset_size);
+          std::sample(std::cbegin(charset), std::cbegin(charset) + charset_size, out, std::intptr_t(n), g);
+          out += n;
+          length -= n;
+        }
+      }
+
+      template<typename URBG>
+      static std::string gen_string(std::size_t length, URBG &&g) {
+        std::string result;
+        result.resize(length);
+        gen_into(result.data(), length, std::forward<URBG>(g));
+        return result;
+      }
+
+      static const constexpr auto MAX_OPS = 7;
+
+      /**
+       * Main loop of the IO service.
+       * The shared_ptr parameter ensures that the ModernIOService object stays alive while the main loop is running.
+       */
+      asio::awaitable<void> main(std::shared_ptr<ModernIOServiceImpl> /* captured_self */) {
+        const constexpr auto TAG = "SrvCo";
+        auto exe = co_await asio::this_coro::executor;
+        auto use_awaitable = asio::bind_executor(exe, asio::use_awaitable);
+
+        for (size_t ops = 0; ops < MAX_OPS; ops++) {
+          timer.expires_after(std::chrono::milliseconds(1000));
+          co_await timer.async_wait(asio::experimental::as_tuple(use_awaitable));
+          if (closing)
+            break;
+
+          CAS_LOG(trace, TAG) << "Ops " << ops << std::endl;
+
+          if (options.production == production_mode::eager && !co_await produce_tick(ops))
+            break;
+
+          {
+            std::lock_guard lock{buffers_mutex};
+            auto consumed = std::string_view(buffer_in).substr(0, 4);
+            CAS_LOG(debug, TAG) << "Consumed: " << consumed << std::endl;
+            buffer_in.erase(0, consumed.size());
+          }
+          sync_memory_usage();
+        }
+        finish_production();
+        CAS_LOG(debug, TAG) << "Done" << std::endl;
+      }
+
+      /// No more data will be produced. The parked reads get what is left and then eof.
+      void finish_production() {
+        done = true;
+        compaction_timer.cancel();
+        serve_parked_reads();
+      }
+
+      /**
+       * Produces the chunk of one tick of the main loop into `buffer_out` and hands it to the parked reads.
+       * @return False if the production must stop.
+       */
+      asio::awaitable<bool> produce_tick(size_t ops) {
+        const constexpr auto TAG = "SrvCo";
+        auto use_awaitable = asio::bind_executor(co_await asio::this_coro::executor, asio::use_awaitable);
+
+        auto produced = gen_string(8, gen);
+        // Backpressure: wait until the memory budget allows the data. Ops keep running on the strand meanwhile.
+        auto needed = produced.size() * (options.retain_log ? 2 : 1);
+        if (!memory->try_charge(needed)) { // only wait when the fast path fails, waiting allocates and posts
+          auto [charge_ec] = co_await memory->async_charge(needed, asio::experimental::as_tuple(use_awaitable));
+          if (charge_ec == asio::error::operation_aborted && closing)
+            co_return false;
+          if (charge_ec) {
+            CAS_LOG(warn, TAG) << "W: Skipped production: " << charge_ec.message() << std::endl;
+            co_return true;
+          }
+        }
+        adopt_charge(needed);
+
+        {
+          CAS_ALLOC_SCOPE(service_buffers); // scopes must not span a co_await
+          if (options.retain_log)
+            logs[ops % logs.size()].append(produced);
+          std::lock_guard lock{buffers_mutex};
+          buffer_out += produced;
+          if (auto max = options.retention.max_buffer_out_bytes; max != 0 && buffer_out.size() > max)
+            buffer_out.erase(0, buffer_out.size() - max);
+          CAS_LOG(debug, TAG) << "Produced: " << buffer_out << std::endl;
+        }
+        serve_parked_reads();
+        co_return true;
+      }
+
+      /**
+       * Applies the retention policy to the log partitions until the main loop is done.
+       * The work is split into steps of at most one segment.
+       * After every slice the coroutine reposts itself to the strand so that pending ops are not blocked.
+       */
+      asio::awaitable<void> compactor(std::shared_ptr<ModernIOServiceImpl> /* captured_self */) {
+        const constexpr auto TAG = "SrvCmp";
+        auto exe = co_await asio::this_coro::executor;
+        auto use_awaitable = asio::bind_executor(exe, asio::use_awaitable);
+        auto &policy = options.retention;
+
+        while (!done) {
+          compaction_timer.expires_after(policy.interval);
+          co_await compaction_timer.async_wait(asio::experimental::as_tuple(use_awaitable));
+          if (done)
+            break;
+
+          auto slice_end = std::chrono::steady_clock::now() + policy.slice_budget;
+          size_t steps = 0;
+          for (auto &log: logs) {
+            uint64_t cursor = 0;
+            auto now = SegmentedLog::clock::now();
+            while ((policy.max_age.count() != 0 && log.expire_step(now, policy.max_age)) ||
+                   (policy.max_bytes != 0 && log.trim_step(policy.max_bytes)) ||
+                   log.compact_step(cursor)) {
+              steps++;
+              if (std::chrono::steady_clock::now() >= slice_end) {
+                co_await asio::post(use_awaitable); // let the pending ops run
+                slice_end = std::chrono::steady_clock::now() + policy.slice_budget;
+              }
+            }
+          }
+          if (steps != 0) {
+            CAS_LOG(debug, TAG) << "Compaction steps " << steps << std::endl;
+          }
+          sync_memory_usage();
+        }
+      }
+
+    public:
+
+      /**
+       * Hands the data in `buffer_out` to the parked reads.
+       * When no more data will be produced the remaining reads complete with eof.
+       * The completions are delivered with one post per caller executor.
+       */
+      void serve_parked_reads() {
+        CompletionBatch completions;
+        std::unique_lock lock{buffers_mutex};
+        for (auto it = active_pipelines.begin(); it != active_pipelines.end();) {
+          auto &pipeline = **it;
+          while (!pipeline.reads.empty() && (!buffer_out.empty() || done || produces_on_demand())) {
+            auto read = std::move(pipeline.reads.front());
+            pipeline.reads.pop_front();
+            pipeline.outstanding--;
+
+            size_t n;
+            if (buffer_out.empty()) {
+              n = produce_into(read->buffer, read->buffer.size());
+            } else {
+              n = asio::buffer_copy(read->buffer, asio::buffer(buffer_out.view()));
+              buffer_out.erase(0, n);
+            }
+            completions.add(std::move(read), n == 0 && done ? boost::system::error_code{asio::stream_errc::eof}
+                                                            : boost::system::error_code{}, n);
+          }
+          if (pipeline.reads.empty())
+            it = active_pipelines.erase(it);
+          else
+            ++it;
+        }
+        lock.unlock();
+        completions.post();
+        sync_memory_usage();
+      }
+
+      /**
+       * Note: The constructor of the service is called from a foreign executor!
+       *       When you want to init executor specific things do it in the init function.
+       */
+      explicit ModernIOServiceImpl(Executor &&exe, ModernIOServiceOptions options) : strand{exe}, options{options},
+                                                                                     logs(std::max<size_t>(1, options.log_partitions),
+                                                                                          SegmentedLog{options.log_segment_bytes,
+                                                                                                       options.retention.key_of}),
+                                                                                     memory{MemoryGovernor::instance().register_account(
+                                                                                       options.name, options.memory_weight, strand)},
+                                                                                     ops_limiter{options.max_concurrent_ops == 0 ? nullptr
+                                                                                                 : std::make_shared<ConcurrencyLimiter>(
+                                                                                         options.max_concurrent_ops, options.ops_saturation_policy)},
+                                                                                     faults{options.faults.has_value()
+                                                                                            ? std::make_unique<FaultInjection::FaultInjector>(*options.faults)
+                                                                                            : nullptr},
+                                                                                     compaction_timer{exe.context()},
+                                                                                     drain_timer{exe.context()},
+                                                                                     timer{exe.context()} {}
+
+      /**
+       * This function is called by the wrapper from a foreign executor!
+       * However, as it invoked after the constructor so `shared_from_this()` is available.
+       */
+      void init() {
+        // if we wanted to init things on OUR executor
+        asio::post(asio::bind_executor(strand, [this, captured_self = this->shared_from_this()]() {
+          CAS_LOG(info, "") << "ModernIOServiceImpl init" << std::endl;
+        }));
+
+        // start the main io service loop
+        CAS_ALLOC_SCOPE(co_spawn_frames);
+        asio::co_spawn(strand, main(this->shared_from_this()), asio::detached);
+        if (options.retain_log && options.retention.applies_to_log())
+          asio::co_spawn(strand, compactor(this->shared_from_this()), asio::detached);
+      }
+
+      /// @return The bytes held by the buffers and logs. Must be called on the strand with `buffers_mutex` held.
+      size_t memory_in_use() const {
+        auto bytes = buffer_in.size() + buffer_out.size();
+        for (auto &log: logs)
+          bytes += log.size_bytes();
+        return bytes;
+      }
+
+      /**
+       * Brings the charge of the memory account in line with `memory_in_use()`.
+       * Freed memory is released to the budget, growth that was not charged up front is charged now.
+       * Must be called on the strand after the buffers or logs changed.
+       * Also wakes up a `shutdown` that waits for `buffer_out` to be drained.
+       */
+      void sync_memory_usage() {
+        std::lock_guard lock{buffers_mutex};
+        readable_bytes = buffer_out.size();
+        auto in_use = memory_in_use();
+        if (in_use > accounted_bytes)
+          memory->force_charge(in_use - accounted_bytes);
+        else if (in_use < accounted_bytes)
+          memory->release(accounted_bytes - in_use);
+        accounted_bytes = in_use;
+        if (closing && buffer_out.empty())
+          drain_timer.cancel();
+      }
+
+      /**
+       * Stops the service so that it can be destroyed. Must be called on the strand.
+       * Writes are refused from now on and the production stops. The data in `buffer_in` is consumed at once.
+       * Reads may drain `buffer_out` until `deadline`, what is left then is discarded.
+       * @return `timed_out` if data had to be discarded.
+       */
+      asio::awaitable<boost::system::error_code> shutdown(std::chrono::steady_clock::time_point deadline) {
+        const constexpr auto TAG = "SrvDown";
+        auto use_awaitable = asio::bind_executor(co_await asio::this_coro::executor, asio::use_awaitable);
+
+        closing = true;
+        memory->cancel(); // a producer or writer blocked by the memory budget gives up
+        timer.cancel();
+        finish_production();
+
+        {
+          std::lock_guard lock{buffers_mutex};
+          CAS_LOG(debug, TAG) << "Consumed: " << buffer_in << std::endl;
+          buffer_in.clear();
+        }
+        sync_memory_usage();
+
+        auto drained = [this] {
+          std::lock_guard lock{buffers_mutex};
+          return buffer_out.empty();
+        };
+        while (!drained() && std::chrono::steady_clock::now() < deadline) {
+          drain_timer.expires_at(deadline);
+          co_await drain_timer.async_wait(asio::experimental::as_tuple(use_awaitable));
+        }
+        if (drained())
+          co_return boost::system::error_code{};
+
+        {
+          std::lock_guard lock{buffers_mutex};
+          CAS_LOG(warn, TAG) << "W: Discarded " << buffer_out.size() << " undrained bytes" << std::endl;
+          buffer_out.clear();
+        }
+        sync_memory_usage();
+        co_return asio::error::timed_out;
+      }
+
+      /**
+       * Grows the capacity of both buffers to `bytes` and touches their pages,
+       * so that the first ops neither reallocate them nor page fault. Must be called on the strand.
+       */
+      void prewarm(size_t bytes) {
+        CAS_ALLOC_SCOPE(service_buffers);
+        std::lock_guard lock{buffers_mutex};
+        auto size = buffer_in.size();
+        if (bytes > size) {
+          buffer_in.resize(bytes);
+          buffer_in.resize(size);
+        }
+        buffer_out.prefault(bytes);
+      }
+
+      /// @return If reads that find `buffer_out` empty can still be served by `produce_into`.
+      bool produces_on_demand() const {
+        return options.production == production_mode::on_demand && !done;
+      }
+
+      /**
+       * Generates data straight into the buffer of a reader in `production_mode::on_demand`.
+       * Must be called on the strand. Call `sync_memory_usage()` afterwards, the log may have grown.
+       * @return The bytes produced. Zero once the main loop is done.
+       */
+      template<typename MutableBufferSequence>
+      size_t produce_into(const MutableBufferSequence &buffer, size_t max_bytes) {
+        if (!produces_on_demand())
+          return 0;
+        size_t n = 0;
+        for (auto it = asio::buffer_sequence_begin(buffer); it != asio::buffer_sequence_end(buffer) && n < max_bytes; ++it) {
+          asio::mutable_buffer part = *it;
+          auto length = std::min(part.size(), max_bytes - n);
+          auto out = static_cast<char *>(part.data());
+          gen_into(out, length, gen);
+          if (options.retain_log && length != 0) {
+            CAS_ALLOC_SCOPE(service_buffers);
+            logs[produced_on_demand++ % logs.size()].append({out, length});
+          }
+          n += length;
+        }
+        CAS_LOG(debug, "SrvCo") << "Produced on demand: " << n << " bytes" << std::endl;
+        return n;
+      }
+
+      /// Takes over bytes that were charged to `memory` before the buffers grow.
+      void adopt_charge(size_t n) {
+        std::lock_guard lock{buffers_mutex};
+        accounted_bytes += n;
+      }
+
+      /**
+       * Lets the `try_` ops access the buffers. The first call asks the strand to start locking `buffers_mutex`,
+       * until then the `try_` ops fail with `would_block`. Services that never see a `try_` op never lock.
+       */
+      void share_buffers() {
+        if (buffers_mutex.request_share())
+          asio::post(strand, [self = this->shared_from_this()] {
+            self->buffers_mutex.share();
+          });
+      }
+
+      /// Queues a read of a pipelined stream. Must be called on the strand.
+      void park_read(const std::shared_ptr<ReadPipeline> &pipeline, std::unique_ptr<ParkedRead> read) {
+        if (pipeline->reads.empty())
+          active_pipelines.push_back(pipeline);
+        pipeline->reads.push_back(std::move(read));
+        serve_parked_reads();
+      }
+
+      /// @return A work guard that ensures that the destructor can run.
+      ///         The service wrapper uses the executor that is associate with the work guard.
+      auto make_destructor_work_guard() {
+        // return asio::make_work_guard(); // use this if there are no requirements for the destructor
+        return asio::make_work_guard(strand);
+      }
+
+      /// The service wrapper ensures that this destructor is called on the destructor_work_guards executor.
+      ~ModernIOServiceImpl() {
+        CAS_LOG(info, "") << "ModernIOServiceImpl destructor" << std::endl;
+        if (destroyed_signal != nullptr)
+          destroyed_signal->expires_at(std::chrono::steady_clock::time_point::min());
+      }
+    };
+
+    /**
+     * Draws the fault of an op and waits its delay on the executor of the calling coroutine.
+     * The op is expected to complete with `fault.error` if it is set.
+     */
+    inline asio::awaitable<FaultInjection::Fault> inject_fault(FaultInjection::FaultInjector &faults, bool is_read) {
+      auto fault = faults.next(is_read);
+      if (fault.delay > FaultInjection::duration::zero()) {
+        asio::steady_timer delay{co_await asio::this_coro::executor, fault.delay};
+        co_await delay.async_wait(use_nothrow_awaitable);
+      }
+      co_return fault;
+    }
+
+    /**
+     * In case you just want an AsyncReadStream or an AsyncWriteStream just omit either async_read_some or async_write_some.
+     * https://www.boost.org/doc/libs/1_66_0/doc/html/boost_asio/reference/AsyncReadStream.html
+     */
+    template<typename CallerExecutor, typename ModernIOServiceImplType> requires my_is_executor<CallerExecutor>::value
+    class MyAsyncStream {
+      /// Holds the io objects bound executor.
+      CallerExecutor executor;
+      /// Use a weak_ptr to behave like a file descriptor.
+      std::weak_ptr<ModernIOServiceImplType> impl_ptr;
+      /// Only set in pipelined mode.
+      std::shared_ptr<ReadPipeline> pipeline;
+
+      /// The pipelined mode does not spawn a coroutine. Posts to the strand from this thread are executed in order.
+      template<typename MutableBufferSequence, typename Handler>
+      void initiate_pipelined_read(const MutableBufferSequence &buffer, Handler &&completion_handler) {
+        auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+
+        auto impl = this->impl_ptr.lock();
+        if (impl == nullptr || pipeline->outstanding >= pipeline->max_outstanding) {
+          boost::system::error_code ec = impl == nullptr ? asio::error::bad_descriptor : asio::error::try_again;
+          complete_at_initiation(comp_executor, std::move(completion_handler), ec, size_t{0});
+          return;
+        }
+        pipeline->outstanding++;
+
+        std::unique_ptr<ParkedRead> read = std::make_unique<ParkedReadOp<std::decay_t<Handler>,
+          decltype(asio::make_work_guard(comp_executor))>>(
+          first_buffer(buffer), std::move(completion_handler), asio::make_work_guard(comp_executor));
+        auto strand = impl->strand;
+        asio::post(strand, [impl = std::move(impl), pipeline = pipeline, read = std::move(read)]() mutable {
+          impl->park_read(pipeline, std::move(read));
+        });
+      }
+
+    public:
+      explicit MyAsyncStream(std::shared_ptr<ModernIOServiceImplType> &&impl, CallerExecutor &exe) : executor{exe},
+                                                                                                     impl_ptr{impl} {}
+
+      /**
+       * Creates a pipelined stream.
+       * Up to `max_outstanding_reads` calls to `async_read_some` may be pending at the same time.
+       * They are queued by the service and completed in issue order as soon as data is available.
+       */
+      explicit MyAsyncStream(std::shared_ptr<ModernIOServiceImplType> &&impl, CallerExecutor &exe,
+                             size_t max_outstanding_reads) : executor{exe}, impl_ptr{impl},
+                                                             pipeline{std::make_shared<ReadPipeline>(
+                                                               max_outstanding_reads)} {}
+
+      /// Needed by the stream specification.
+      typedef CallerExecutor executor_type;
+
+      /// @return Returns the executor supplied in the constructor.
+      auto get_executor() {
+        return executor;
+      }
+
+      /**
+       * Used by stream to stream operations like `async_splice` to access the service directly.
+       * @return The service or `nullptr` if it is gone.
+       */
+      std::shared_ptr<ModernIOServiceImplType> lock_impl() const {
+        return impl_ptr.lock();
+      }
+
+      typedef void async_rw_handler(boost::system::error_code, size_t);
+
+      template<typename MutableBufferSequence,
+        asio::completion_token_for<async_rw_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      requires asio::is_mutable_buffer_sequence<MutableBufferSequence>::value
+      auto async_read_some(const MutableBufferSequence &buffer,
+                           CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_rw_handler>(
+          [this, buffer](auto completion_handler) {
+            CAS_ALLOC_SCOPE(stream_ops);
+            if (pipeline != nullptr) {
+              initiate_pipelined_read(buffer, std::move(completion_handler));
+              return;
+            }
+
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            auto impl = this->impl_ptr.lock();
+            if (impl == nullptr) {
+              complete_at_initiation(comp_executor, std::move(completion_handler), asio::error::bad_descriptor, size_t{0});
+              return;
+            }
+            limit_initiation<async_rw_handler>(impl->ops_limiter, comp_executor,
+                                               std::move(completion_handler),
+                                               [this, buffer](auto comp_executor, auto completion_handler) {
+              CAS_ALLOC_SCOPE(co_spawn_frames);
+              asio::co_spawn(comp_executor, [this, completion_handler = std::move(completion_handler),
+                buffer] // Pass the buffer by value. Cheap because it only points to memory owned by the caller.
+                () mutable -> asio::awaitable<void> {
+                const constexpr auto TAG = "ARS";
+                auto comp_executor = co_await asio::this_coro::executor; // TODO: check if capturing it is better
+                auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+                auto impl = this->impl_ptr.lock();
+                if (impl == nullptr) {
+                  std::move(completion_handler)(asio::error::bad_descriptor, 0);
+                  co_return;
+                }
+
+                double read_fraction = 1;
+                if (impl->faults != nullptr) {
+                  auto fault = co_await inject_fault(*impl->faults, true);
+                  if (fault.error) {
+                    std::move(completion_handler)(fault.error, 0);
+                    co_return;
+                  }
+                  read_fraction = fault.read_fraction;
+                }
+
+                auto to_impl = asio::bind_executor(impl->strand, asio::use_awaitable);
+                co_await asio::post(to_impl);
+                CAS_BLOG(trace, TAG, "performing read");
+
+                auto buf_begin = asio::buffers_begin(buffer);
+                auto buf_end = asio::buffers_end(buffer);
+                boost::system::error_code err = asio::error::fault;
+                size_t it = 0;
+                {
+                  std::lock_guard lock{impl->buffers_mutex};
+                  bool on_demand = impl->buffer_out.empty() && impl->produces_on_demand();
+                  auto available = on_demand ? asio::buffer_size(buffer) : impl->buffer_out.size();
+                  auto max_bytes = read_fraction < 1
+                                   ? std::max<size_t>(1, static_cast<size_t>(static_cast<double>(available) * read_fraction))
+                                   : std::numeric_limits<size_t>::max();
+                  if (on_demand) { // generate straight into the caller's buffer
+                    it = impl->produce_into(buffer, max_bytes);
+                    err = it != 0 || available == 0 ? boost::system::error_code{} : boost::system::error_code{asio::stream_errc::eof};
+                    goto completion;
+                  }
+                  while (!impl->buffer_out.empty()) {
+                    if (it == max_bytes) { // injected partial read
+                      err = {};
+                      goto completion;
+                    }
+                    if (buf_begin == buf_end) {
+                      // error the buffer is smaller than the request read amount
+                      err = asio::error::no_buffer_space;
+                      goto completion;
+                    }
+
+                    *buf_begin++ = impl->buffer_out.at(0);
+                    impl->buffer_out.erase(0, 1);
+                    it++;
+                  }
+                  err = asio::stream_errc::eof;
+                }
+                completion:
+                impl->sync_memory_usage();
+                co_await asio::post(to_comp); // without this call the function returns on the wrong thread
+                CAS_BLOG(trace, TAG, "read done returned");
+                std::move(completion_handler)(err, it);
+              }, asio::detached);
+            });
+          }, token);
+      }
+
+      template<typename ConstBufferSequence,
+        asio::completion_token_for<async_rw_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      requires asio::is_const_buffer_sequence<ConstBufferSequence>::value
+      auto async_write_some(const ConstBufferSequence &buffer,
+                            CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_rw_handler>([this, buffer](auto completion_handler) {
+          CAS_ALLOC_SCOPE(stream_ops);
+          auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+          auto impl = this->impl_ptr.lock();
+          if (impl == nullptr) {
+            complete_at_initiation(comp_executor, std::move(completion_handler), asio::error::bad_descriptor, size_t{0});
+            return;
+          }
+          limit_initiation<async_rw_handler>(impl->ops_limiter, comp_executor,
+                                             std::move(completion_handler),
+                                             [this, buffer](auto comp_executor, auto completion_handler) {
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor,
+                           [this, completion_handler = std::move(completion_handler), buffer]
+                             () mutable -> asio::awaitable<void> {
+                             const constexpr auto TAG = "AWS";
+                             auto comp_executor = co_await asio::this_coro::executor;
+                             auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+                             auto impl = this->impl_ptr.lock();
+                             if (impl == nullptr) {
+                               std::move(completion_handler)(asio::error::bad_descriptor, 0);
+                               co_return;
+                             }
+
+                             if (impl->faults != nullptr) {
+                               auto fault = co_await inject_fault(*impl->faults, false);
+                               if (fault.error) {
+                                 std::move(completion_handler)(fault.error, 0);
+                                 co_return;
+                               }
+                             }
+
+                             // Backpressure: wait until the memory budget allows the data.
+                             auto size = asio::buffer_size(buffer);
+                             if (!impl->memory->try_charge(size)) {
+                               auto [charge_ec] = co_await impl->memory->async_charge(size, asio::experimental::as_tuple(to_comp));
+                               if (charge_ec) {
+                                 std::move(completion_handler)(charge_ec, 0);
+                                 co_return;
+                               }
+                             }
+
+                             auto to_impl = asio::bind_executor(impl->strand, asio::use_awaitable);
+                             co_await asio::post(to_impl);
+                             if (impl->closing) {
+                               impl->memory->release(size);
+                               co_await asio::post(to_comp);
+                               std::move(completion_handler)(asio::error::shut_down, 0);
+                               co_return;
+                             }
+                             impl->adopt_charge(size);
+                             CAS_BLOG(trace, TAG, "performing write");
+
+                             auto buf_begin = asio::buffers_begin(buffer);
+                             auto buf_end = asio::buffers_end(buffer);
+                             boost::system::error_code err = asio::error::fault;
+                             size_t it = 0;
+                             {
+                               CAS_ALLOC_SCOPE(service_buffers);
+                               std::lock_guard lock{impl->buffers_mutex};
+                               while (buf_begin != buf_end) {
+                                 impl->buffer_in.push_back(static_cast<char>(*buf_begin++));
+                                 it++;
+                               }
+                             }
+                             err = asio::stream_errc::eof;
+                             completion:
+                             co_await asio::post(to_comp);
+                             CAS_BLOG(trace, TAG, "write done returned");
+                             std::move(completion_handler)(err, it);
+                           }, asio::detached);
+          });
+        }, token);
+      }
+
+      // region try ops
+
+      /**
+       * Reads the buffered data without waiting and without leaving the calling thread.
+       * Fails with `would_block` where `async_read_some` would have to wait:
+       * nothing is buffered, the service is changing its buffers right now or reads of the pipeline are outstanding.
+       * The first `try_` op on a service also fails, it enables the locking of the buffers (`share_buffers()`).
+       * The empty check does not take a lock. Bypasses the fault injection, the ops limit and the on demand production.
+       * @return The bytes read.
+       */
+      template<typename MutableBufferSequence>
+      requires asio::is_mutable_buffer_sequence<MutableBufferSequence>::value
+      size_t try_read_some(const MutableBufferSequence &buffer, boost::system::error_code &ec) {
+        auto impl = this->impl_ptr.lock();
+        if (impl == nullptr) {
+          ec = asio::error::bad_descriptor;
+          return 0;
+        }
+        ec = asio::error::would_block;
+        impl->share_buffers();
+        if (impl->readable_bytes.load() == 0 || (pipeline != nullptr && pipeline->outstanding.load() != 0))
+          return 0;
+        std::unique_lock lock{impl->buffers_mutex, std::try_to_lock};
+        if (!lock.owns_lock() || impl->buffer_out.empty())
+          return 0;
+
+        auto n = asio::buffer_copy(buffer, asio::buffer(impl->buffer_out.view()));
+        impl->buffer_out.erase(0, n);
+        impl->readable_bytes = impl->buffer_out.size();
+        impl->accounted_bytes -= n;
+        impl->memory->release(n);
+        if (impl->closing && impl->buffer_out.empty()) // wake up the shutdown that waits for the drain
+          asio::post(impl->strand, [impl] {
+            impl->sync_memory_usage();
+          });
+        ec = {};
+        return n;
+      }
+
+      /**
+       * Writes without waiting and without leaving the calling thread.
+       * Fails with `would_block` where `async_write_some` would have to wait:
+       * the memory budget doesn't allow the data right now or the service is changing its buffers right now.
+       * The first `try_` op on a service also fails, see `try_read_some`.
+       * Unlike `async_write_some` a complete write succeeds instead of reporting eof.
+       * Bypasses the fault injection and the ops limit.
+       * @return The bytes written.
+       */
+      template<typename ConstBufferSequence>
+      requires asio::is_const_buffer_sequence<ConstBufferSequence>::value
+      size_t try_write_some(const ConstBufferSequence &buffer, boost::system::error_code &ec) {
+        auto impl = this->impl_ptr.lock();
+        if (impl == nullptr) {
+          ec = asio::error::bad_descriptor;
+          return 0;
+        }
+        auto size = asio::buffer_size(buffer);
+        ec = asio::error::would_block;
+        impl->share_buffers();
+        if (!impl->memory->try_charge(size))
+          return 0;
+        std::unique_lock lock{impl->buffers_mutex, std::try_to_lock};
+        if (!lock.owns_lock() || impl->closing) { // checked under the lock, the shutdown consumes `buffer_in` under it
+          if (impl->closing)
+            ec = asio::error::shut_down;
+          impl->memory->release(size);
+          return 0;
+        }
+
+        {
+          CAS_ALLOC_SCOPE(service_buffers);
+          for (auto it = asio::buffer_sequence_begin(buffer); it != asio::buffer_sequence_end(buffer); ++it) {
+            asio::const_buffer part = *it;
+            impl->buffer_in.append(static_cast<const char *>(part.data()), part.size());
+          }
+        }
+        impl->accounted_bytes += size;
+        ec = {};
+        return size;
+      }
+
+      // endregion
+    };
+
+    /**
+     * A seekable stream over the retained log of the service.
+     * It is an AsyncReadStream and an AsyncRandomAccessReadDevice, so `asio::async_read_at` works with it.
+     * Reading does not consume the data, multiple log streams can replay the same data.
+     */
+    template<typename CallerExecutor, typename ModernIOServiceImplType> requires my_is_executor<CallerExecutor>::value
+    class MyLogStream {
+      /// Holds the io objects bound executor.
+      CallerExecutor executor;
+      /// Use a weak_ptr to behave like a file descriptor.
+      std::weak_ptr<ModernIOServiceImplType> impl_ptr;
+      /// The partition of the log that is read.
+      size_t partition;
+      /// The offset the next `async_read_some` starts at.
+      uint64_t pos = 0;
+
+      /**
+       * Reads from the log on the service strand and returns to the caller executor.
+       * @param skip_removed Start at the oldest retained data instead of failing if `offset` was removed.
+       * @return The error, the offset of the first byte read and the number of bytes read.
+       */
+      asio::awaitable<std::tuple<boost::system::error_code, uint64_t, size_t>>
+      read_log(uint64_t offset, asio::mutable_buffer buffer, bool skip_removed) {
+        const constexpr auto TAG = "LRS";
+        auto comp_executor = co_await asio::this_coro::executor;
+        auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+        auto impl = this->impl_ptr.lock();
+        if (impl == nullptr)
+          co_return std::make_tuple(boost::system::error_code{asio::error::bad_descriptor}, offset, size_t{0});
+
+        auto to_impl = asio::bind_executor(impl->strand, asio::use_awaitable);
+        co_await asio::post(to_impl);
+        CAS_BLOG(trace, TAG, "performing read at {}", offset);
+
+        boost::system::error_code err;
+        SegmentedLog::Read read{offset, 0};
+        if (!impl->options.retain_log)
+          err = asio::error::operation_not_supported;
+        else if (partition >= impl->logs.size())
+          err = asio::error::invalid_argument;
+        else if (offset < impl->logs[partition].begin_offset() && !skip_removed)
+          err = asio::error::invalid_argument; // the data is no longer retained
+        else if (offset >= impl->logs[partition].end_offset())
+          err = asio::stream_errc::eof;
+        else
+          read = impl->logs[partition].read(offset, {static_cast<char *>(buffer.data()), buffer.size()});
+
+        co_await asio::post(to_comp);
+        co_return std::make_tuple(err, read.offset, read.size);
+      }
+
+    public:
+      explicit MyLogStream(std::shared_ptr<ModernIOServiceImplType> &&impl, CallerExecutor &exe, size_t partition)
+        : executor{exe}, impl_ptr{impl}, partition{partition} {}
+
+      /// Needed by the stream specification.
+      typedef CallerExecutor executor_type;
+
+      /// @return Returns the executor supplied in the constructor.
+      auto get_executor() {
+        return executor;
+      }
+
+      /// Sets the offset the next `async_read_some` starts at.
+      void seek(uint64_t offset) {
+        pos = offset;
+      }
+
+      /// @return The offset the next `async_read_some` starts at.
+      uint64_t tell() const {
+        return pos;
+      }
+
+      typedef void async_rw_handler(boost::system::error_code, size_t);
+
+      /**
+       * Reads the data at `offset` without changing the stream position.
+       * Completes with eof when there is no data at `offset` yet
+       * and with `invalid_argument` when the data at `offset` is no longer retained or was compacted.
+       */
+      template<typename MutableBufferSequence,
+        asio::completion_token_for<async_rw_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      requires asio::is_mutable_buffer_sequence<MutableBufferSequence>::value
+      auto async_read_some_at(uint64_t offset, const MutableBufferSequence &buffer,
+                              CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_rw_handler>(
+          [this, offset, buffer](auto completion_handler) {
+            CAS_ALLOC_SCOPE(stream_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, offset, buffer = first_buffer(buffer),
+              completion_handler = std::move(completion_handler)]() mutable -> asio::awaitable<void> {
+              auto [err, first, n] = co_await read_log(offset, buffer, false);
+              if (n != 0 && first != offset) { // `offset` is in a gap left by compaction
+                err = asio::error::invalid_argument;
+                n = 0;
+              }
+              std::move(completion_handler)(err, n);
+            }, asio::detached);
+          }, token);
+      }
+
+      /// Reads at the stream position and advances it. Data removed by the retention policy is skipped.
+      template<typename MutableBufferSequence,
+        asio::completion_token_for<async_rw_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      requires asio::is_mutable_buffer_sequence<MutableBufferSequence>::value
+      auto async_read_some(const MutableBufferSequence &buffer,
+                           CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_rw_handler>(
+          [this, buffer](auto completion_handler) {
+            CAS_ALLOC_SCOPE(stream_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, buffer = first_buffer(buffer),
+              completion_handler = std::move(completion_handler)]() mutable -> asio::awaitable<void> {
+              auto [err, first, n] = co_await read_log(pos, buffer, true);
+              if (n != 0)
+                pos = first + n;
+              std::move(completion_handler)(err, n);
+            }, asio::detached);
+          }, token);
+      }
+    };
+
+    /**
+     * A member of a consumer group.
+     * It is an AsyncReadStream over the log partitions that are currently assigned to it.
+     * Copies share the membership. The member leaves the group when the last copy is destroyed.
+     */
+    template<typename CallerExecutor, typename ModernIOServiceImplType> requires my_is_executor<CallerExecutor>::value
+    class MyGroupConsumer {
+      /// Leaves the group on destruction.
+      struct Membership {
+        std::weak_ptr<ModernIOServiceImplType> impl_ptr;
+        std::string group;
+        /// Zero until joined.
+        uint64_t member_id = 0;
+
+        Membership(std::weak_ptr<ModernIOServiceImplType> impl_ptr, std::string group) : impl_ptr{std::move(impl_ptr)},
+                                                                                        group{std::move(group)} {}
+
+        ~Membership() {
+          auto impl = impl_ptr.lock();
+          if (impl == nullptr || member_id == 0)
+            return;
+          auto strand = impl->strand;
+          asio::post(strand, [impl = std::move(impl), group = std::move(group), member_id = member_id]() {
+            if (auto it = impl->groups.find(group); it != impl->groups.end())
+              it->second.leave(member_id);
+          });
+        }
+      };
+
+      /// Holds the io objects bound executor.
+      CallerExecutor executor;
+      /// Use a weak_ptr to behave like a file descriptor.
+      std::weak_ptr<ModernIOServiceImplType> impl_ptr;
+      std::shared_ptr<Membership> membership;
+      /// The partition the next read starts looking at. Spreads the reads over the assigned partitions.
+      size_t next_partition = 0;
+
+      /// Runs `function(impl, group)` on the service strand and returns its result on the caller executor.
+      template<typename Result, typename Function>
+      asio::awaitable<Result> run_on_service(Function function) {
+        auto comp_executor = co_await asio::this_coro::executor;
+        auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+        Result result{};
+        auto impl = this->impl_ptr.lock();
+        if (impl == nullptr) {
+          std::get<0>(result) = asio::error::bad_descriptor;
+          co_return result;
+        }
+
+        auto to_impl = asio::bind_executor(impl->strand, asio::use_awaitable);
+        co_await asio::post(to_impl);
+
+        if (!impl->options.retain_log)
+          std::get<0>(result) = asio::error::operation_not_supported;
+        else
+          result = function(*impl, impl->groups.try_emplace(membership->group, impl->logs.size()).first->second);
+
+        co_await asio::post(to_comp);
+        co_return result;
+      }
+
+    public:
+      explicit MyGroupConsumer(std::shared_ptr<ModernIOServiceImplType> &&impl, CallerExecutor &exe, std::string group)
+        : executor{exe}, impl_ptr{impl},
+          membership{std::make_shared<Membership>(impl, std::move(group))} {}
+
+      /// Needed by the stream specification.
+      typedef CallerExecutor executor_type;
+
+      /// @return Returns the executor supplied in the constructor.
+      auto get_executor() {
+        return executor;
+      }
+
+      typedef void async_join_handler(boost::system::error_code);
+
+      /// Joins the group. This rebalances the partitions of the group.
+      template<asio::completion_token_for<async_join_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      auto async_join(CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_join_handler>(
+          [this](auto completion_handler) {
+            CAS_ALLOC_SCOPE(stream_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, completion_handler = std::move(completion_handler)]
+              () mutable -> asio::awaitable<void> {
+              const constexpr auto TAG = "GJN";
+              auto [err] = co_await run_on_service<std::tuple<boost::system::error_code>>(
+                [this](ModernIOServiceImplType &impl, ConsumerGroup &group) {
+                  if (membership->member_id != 0)
+                    return std::make_tuple(boost::system::error_code{asio::error::already_connected});
+                  membership->member_id = ++impl.last_member_id;
+                  group.join(membership->member_id);
+                  CAS_LOG(info, TAG) << "member " << membership->member_id << " joined " << membership->group
+                                     << " generation " << group.generation << std::endl;
+                  return std::make_tuple(boost::system::error_code{});
+                });
+              std::move(completion_handler)(err);
+            }, asio::detached);
+          }, token);
+      }
+
+      typedef void async_rw_handler(boost::system::error_code, size_t);
+
+      /**
+       * Reads from one of the partitions assigned to this member.
+       * Completes with eof when none of them has unread data.
+       */
+      template<typename MutableBufferSequence,
+        asio::completion_token_for<async_rw_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      requires asio::is_mutable_buffer_sequence<MutableBufferSequence>::value
+      auto async_read_some(const MutableBufferSequence &buffer,
+                           CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_rw_handler>(
+          [this, buffer](auto completion_handler) {
+            CAS_ALLOC_SCOPE(stream_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, buffer = first_buffer(buffer),
+              completion_handler = std::move(completion_handler)]() mutable -> asio::awaitable<void> {
+              auto [err, partition, n] = co_await run_on_service<std::tuple<boost::system::error_code, size_t, size_t>>(
+                [this, buffer](ModernIOServiceImplType &impl, ConsumerGroup &group) {
+                  auto member_id = membership->member_id;
+                  if (member_id == 0)
+                    return std::make_tuple(boost::system::error_code{asio::error::not_connected}, size_t{0}, size_t{0});
+
+                  auto partitions = impl.logs.size();
+                  for (size_t i = 0; i < partitions; i++) {
+                    auto partition = (next_partition + i) % partitions;
+                    if (!group.owns(member_id, partition))
+                      continue;
+                    auto &log = impl.logs[partition];
+                    auto position = std::max(group.positions[partition], log.begin_offset());
+                    auto read = log.read(position, {static_cast<char *>(buffer.data()), buffer.size()});
+                    if (read.size == 0)
+                      continue;
+                    group.positions[partition] = read.offset + read.size;
+                    return std::make_tuple(boost::system::error_code{}, partition, read.size);
+                  }
+                  return std::make_tuple(boost::system::error_code{asio::stream_errc::eof}, size_t{0}, size_t{0});
+                });
+              if (n != 0)
+                next_partition = partition + 1;
+              std::move(completion_handler)(err, n);
+            }, asio::detached);
+          }, token);
+      }
+
+      typedef void async_commit_handler(boost::system::error_code);
+
+      /**
+       * Commits the read positions of the partitions currently assigned to this member.
+       * Call it after the read data was processed. Uncommitted data is read again after a rebalance.
+       */
+      template<asio::completion_token_for<async_commit_handler>
+        CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      auto async_commit(CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_commit_handler>(
+          [this](auto completion_handler) {
+            CAS_ALLOC_SCOPE(stream_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, completion_handler = std::move(completion_handler)]
+              () mutable -> asio::awaitable<void> {
+              auto [err] = co_await run_on_service<std::tuple<boost::system::error_code>>(
+                [this](ModernIOServiceImplType &/* impl */, ConsumerGroup &group) {
+                  auto member_id = membership->member_id;
+                  if (member_id == 0)
+                    return std::make_tuple(boost::system::error_code{asio::error::not_connected});
+                  for (size_t partition = 0; partition < group.owners.size(); partition++)
+                    if (group.owns(member_id, partition))
+                      group.committed[partition] = group.positions[partition];
+                  return std::make_tuple(boost::system::error_code{});
+                });
+              std::move(completion_handler)(err);
+            }, asio::detached);
+          }, token);
+      }
+    };
+
+    template<typename CallerExecutor, typename ModernIOServiceImplType> requires my_is_executor<CallerExecutor>::value
+    class ModernIOServiceClient {
+      /// Holds the io objects bound executor.
+      CallerExecutor executor;
+      /// Use a weak_ptr to behave like a file descriptor.
+      std::weak_ptr<ModernIOServiceImplType> impl_ptr;
+    public:
+      explicit ModernIOServiceClient(std::shared_ptr<ModernIOServiceImplType> &impl, CallerExecutor &exe) : executor{
+        exe}, impl_ptr{impl} {}
+
+      /// Needed by the stream specification.
+      typedef CallerExecutor executor_type;
+
+      /// @return Returns the executor supplied in the constructor.
+      auto get_executor() {
+        return executor;
+      }
+
+      /// Creates a MyAsyncStream instance.
+      MyAsyncStream<CallerExecutor, ModernIOServiceImplType> make_my_async_stream() {
+        return MyAsyncStream<CallerExecutor, ModernIOServiceImplType>(impl_ptr.lock(), executor);
+      }
+
+      /// Creates a MyLogStream instance positioned at the start of a log partition.
+      MyLogStream<CallerExecutor, ModernIOServiceImplType> make_log_stream(size_t partition = 0) {
+        return MyLogStream<CallerExecutor, ModernIOServiceImplType>(impl_ptr.lock(), executor, partition);
+      }
+
+      /// Creates a MyGroupConsumer instance. It has to join the group before it can read.
+      MyGroupConsumer<CallerExecutor, ModernIOServiceImplType> make_group_consumer(std::string group) {
+        return MyGroupConsumer<CallerExecutor, ModernIOServiceImplType>(impl_ptr.lock(), executor, std::move(group));
+      }
+
+      /// Creates a MyAsyncStream instance that allows multiple outstanding reads.
+      MyAsyncStream<CallerExecutor, ModernIOServiceImplType> make_pipelined_async_stream(size_t max_outstanding_reads) {
+        return MyAsyncStream<CallerExecutor, ModernIOServiceImplType>(impl_ptr.lock(), executor, max_outstanding_reads);
+      }
+
+      /// @return What was injected so far. Empty if the service is gone or has no `options.faults`.
+      FaultInjection::Stats fault_stats() {
+        auto impl = impl_ptr.lock();
+        return impl != nullptr && impl->faults != nullptr ? impl->faults->stats() : FaultInjection::Stats{};
+      }
+
+      // region direct async functions
+
+      /**
+       * This function typedef indicates the RETURN type of the async_functions.
+       * (In this case all functions use the same function typedef because they all return the same values.)
+       *
+       * Note:  Avoid returning more than two values.
+       *        Although it is possible it's rather clunky.
+       *
+       *        Instead I recommend to only return an error_code and the value you want to return.
+       *        The types of the return values MUST be default constructive. (That requirements ironically prevents you from returning boost::outcomes. See the outcome example.)
+       *        If there is no possible error return value the error_code/ec parameter may be omitted.
+       *        You should only throw when the error is unrecoverable otherwise I advise to use error_codes.
+       */
+      typedef void (async_return_function)(boost::system::error_code ec, size_t buffer_in_size, size_t buffer_out_size);
+      //   typedef void (async_return_function)(boost::system::error_code ec, size_t exampleReturnValue1);  // use this to return one value with    error support
+      //   typedef void (async_return_function)(size_t exampleReturnValue1);                                // use this to return one value without error support
+      //   typedef void (async_return_function)(boost::system::error_code ec, struct yourReturnValues);     // use this if you have to return more than one value with error support
+
+      /**
+       * This function shows how to implement a async function with a completion token using `asio::async_initiate`.
+       * This is useful if coroutines aren't available or to reduce overhead.
+       */
+      template<asio::completion_token_for<async_return_function> CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      auto async_buffer_op_initiate(bool buffer_in_clear, bool buffer_out_clear,
+                                    CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_return_function>(
+          [this, buffer_in_clear, buffer_out_clear] // It is imperative to capture any parameters BY VALUE or to forward/move them.
+            (auto completion_handler) {
+            CAS_ALLOC_SCOPE(client_ops);
+            const constexpr auto TAG = "async_buffer_op_initiate_function";
+            // This gets the executor that asio has already conveniently associated with the completion handler and falls back to our bound executor.
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+
+            CAS_LOG(trace, TAG) << "Inside" << std::endl;
+
+            auto impl = this->impl_ptr.lock();
+            if (impl == nullptr) {
+              // Note: Unless the caller opted in with `allow_immediate` the completion_handler MUST be invoked from outside this function.
+              //       For this reason `complete_at_initiation` posts to the assoc_executor before invocation.
+              complete_at_initiation(comp_executor, std::move(completion_handler),
+                                     boost::system::error_code{asio::error::bad_descriptor}, size_t{0}, size_t{0});
+              return;
+            }
+
+            // change to the impl executor to allow safe access to variables
+            auto strand = impl->strand; // This temp is necessary to move the impl in the capture
+            asio::post(strand, [this, &TAG, completion_handler = std::move(completion_handler), impl = std::move(
+              impl),
+              workGuard = asio::make_work_guard(
+                comp_executor), // create a work guard to ensure our target executor stays alive
+              buffer_in_clear, buffer_out_clear] // It is imperative to capture any parameters BY VALUE or to forward/move them.
+              () mutable {
+              CAS_LOG(trace, TAG) << "Work" << std::endl;
+
+              std::unique_lock lock{impl->buffers_mutex};
+              auto buffer_in_size = impl->buffer_in.size(), buffer_out_size = impl->buffer_out.size();
+              if (buffer_in_clear)
+                impl->buffer_in.clear(); // keeps the capacity reserved by `prewarm`
+              if (buffer_out_clear)
+                impl->buffer_out.clear();
+              lock.unlock();
+              impl->sync_memory_usage();
+
+              // std::move(completion_handler)(std::error_code{}, buffer_in_size, buffer_out_size); // ILLEGAL!!! Doing this would leak the service executor to the caller.
+              // Don't forget to post back to the original calling executor.
+              complete_from(workGuard.get_executor(), std::move(completion_handler), boost::system::error_code{},
+                            buffer_in_size, buffer_out_size);
+            });
+          },
+          token);
+      }
+
+      /**
+       * This function shows how to implement a async function with a completion token using an `asio::awaitable`.
+       *
+       * Why don't we just use an awaitable directly?
+       * For generic initiation.
+       * By using co_spawn we make the function look and feel like the stock asio functions as it allows us to take ANY completion token parameter.
+       *
+       * I recommend you to use this approach where possible as it is the easiest and most readable.
+       * It also avoid callback hell.
+       *
+       * Note: To avoid allocating a stack everytime the function is called, it might make sense to provide a separate function for use by other coroutines which directly returns an awaitable.
+       *       Eg: `async_buffer_op_coro_awaitable`
+       *       The `async_buffer_op_coro` function would still contain the `co_spawn` call but inside the coroutine it would simply `co_await async_buffer_op_coro_awaitable(...params, as_tuple)`.
+       *       And then call the completion handler with the results.
+       */
+      template<asio::completion_token_for<async_return_function> CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      auto async_buffer_op_coro(bool buffer_in_clear, bool buffer_out_clear,
+                                CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_return_function>(
+          [this, buffer_in_clear, buffer_out_clear] // It is imperative to capture any parameters BY VALUE or to forward/move them.
+            (auto completion_handler) {
+            CAS_ALLOC_SCOPE(client_ops);
+            const constexpr auto TAG = "async_buffer_op_coro_function";
+
+            // Starting the coroutine directly on the target executor removes the need for a work guard.
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, &TAG, completion_handler = std::move(completion_handler),
+              buffer_in_clear, buffer_out_clear] // It is imperative to capture any parameters BY VALUE or to forward/move them.
+              () mutable -> asio::awaitable<void> {
+              auto comp_executor = co_await asio::this_coro::executor;
+              auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+              CAS_LOG(trace, TAG) << "Inside" << std::endl;
+
+              auto impl = this->impl_ptr.lock();
+              if (impl == nullptr) {
+                std::move(completion_handler)(asio::error::bad_descriptor, 0, 0);
+                co_return;
+              }
+
+              auto to_impl = asio::bind_executor(impl->strand, asio::use_awaitable);
+              co_await asio::post(to_impl);
+              CAS_LOG(trace, TAG) << "Work" << std::endl;
+
+              std::unique_lock lock{impl->buffers_mutex};
+              auto buffer_in_size = impl->buffer_in.size(), buffer_out_size = impl->buffer_out.size();
+              if (buffer_in_clear)
+                impl->buffer_in.clear(); // keeps the capacity reserved by `prewarm`
+              if (buffer_out_clear)
+                impl->buffer_out.clear();
+              lock.unlock();
+              impl->sync_memory_usage();
+
+              co_await asio::post(to_comp);
+              std::move(completion_handler)(std::error_code{}, buffer_in_size, buffer_out_size);
+            }, asio::detached);
+          },
+          token);
+      }
+
+      typedef void (async_prewarm_function)(boost::system::error_code ec, std::chrono::steady_clock::duration elapsed);
+
+      /**
+       * Pays the startup costs of the service before the first real op does.
+       * Prefaults `buffer_bytes` of both service buffers and runs a round trip from the caller executor to the strand and back.
+       * Asio recycles the memory of coroutine frames and handlers per thread, so the round trip and a no-op coroutine
+       * on the strand seed these caches on the caller and the service thread.
+       * `elapsed` is the time the prewarm took.
+       */
+      template<asio::completion_token_for<async_prewarm_function> CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      auto async_prewarm(size_t buffer_bytes,
+                         CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_prewarm_function>(
+          [this, buffer_bytes](auto completion_handler) {
+            CAS_ALLOC_SCOPE(client_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, buffer_bytes, completion_handler = std::move(completion_handler),
+              start = std::chrono::steady_clock::now()]() mutable -> asio::awaitable<void> {
+              auto comp_executor = co_await asio::this_coro::executor;
+              auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+              auto impl = this->impl_ptr.lock();
+              if (impl == nullptr) {
+                std::move(completion_handler)(asio::error::bad_descriptor, std::chrono::steady_clock::duration{});
+                co_return;
+              }
+
+              auto to_impl = asio::bind_executor(impl->strand, asio::use_awaitable);
+              co_await asio::post(to_impl);
+              impl->prewarm(buffer_bytes);
+              co_await asio::co_spawn(impl->strand, []() -> asio::awaitable<void> { co_return; }, to_impl);
+
+              co_await asio::post(to_comp);
+              std::move(completion_handler)(boost::system::error_code{}, std::chrono::steady_clock::now() - start);
+            }, asio::detached);
+          },
+          token);
+      }
+
+      typedef void (async_peek_snapshot_function)(boost::system::error_code ec, CowString::Snapshot snapshot);
+
+      /**
+       * Observes the data produced by the service without consuming it.
+       * The snapshot shares the storage of `buffer_out`, nothing is copied.
+       * The service switches to a fresh buffer on its next change, so readers of the snapshot never slow down the consumer.
+       */
+      template<asio::completion_token_for<async_peek_snapshot_function> CompletionToken = typename asio::default_completion_token<CallerExecutor>::type>
+      auto async_peek_snapshot(CompletionToken &&token = typename asio::default_completion_token<CallerExecutor>::type()) {
+        return asio::async_initiate<CompletionToken, async_peek_snapshot_function>(
+          [this](auto completion_handler) {
+            CAS_ALLOC_SCOPE(client_ops);
+            auto comp_executor = asio::get_associated_executor(completion_handler, this->get_executor());
+            CAS_ALLOC_SCOPE(co_spawn_frames);
+            asio::co_spawn(comp_executor, [this, completion_handler = std::move(completion_handler)]
+              () mutable -> asio::awaitable<void> {
+              auto comp_executor = co_await asio::this_coro::executor;
+              auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+              auto impl = this->impl_ptr.lock();
+              if (impl == nullptr) {
+                std::move(completion_handler)(asio::error::bad_descriptor, nullptr);
+                co_return;
+              }
+
+              co_await asio::post(asio::bind_executor(impl->strand, asio::use_awaitable));
+              auto snapshot = [&] {
+                std::lock_guard lock{impl->buffers_mutex};
+                return impl->buffer_out.snapshot();
+              }();
+
+              co_await asio::post(to_comp);
+              std::move(completion_handler)(boost::system::error_code{}, std::move(snapshot));
+            }, asio::detached);
+          },
+          token);
+      }
+
+      // endregion
+    };
+  }
+
+  /// The wrapper. It hides away the `shared_ptr`. And can be shared between multiple threads.
+  template<typename ServiceExecutor> requires my_is_executor<ServiceExecutor>::value
+  class ModernIOService {
+    using ModernIOServiceImplType = detail::ModernIOServiceImpl<ServiceExecutor>;
+
+    std::shared_ptr<ModernIOServiceImplType> impl;
+
+    /**
+     * The main loop keeps the impl alive after the wrapper is destroyed or moved.
+     * So the deleter must not refer to the wrapper, it owns the work guard that ensures that it can post the destruction.
+     */
+    static std::shared_ptr<ModernIOServiceImplType> make_impl(ServiceExecutor &&exe, ModernIOServiceOptions options) {
+      auto *created = new ModernIOServiceImplType(std::forward<ServiceExecutor>(exe), options);
+      return {created, [workGuard = created->make_destructor_work_guard()](auto *impl) {
+        auto fut = asio::post(workGuard.get_executor(), std::packaged_task<void()>([impl]() { // ensure that the destructor is run on the correct executor
+          delete impl;
+        }));
+        // fut.wait(); // uncomment this line to make the destructor synchronous
+      }};
+    }
+  public:
+    /**
+     * The constructor of this wrapper only accepts executors.
+     * For it to accept execution_contexts directly we would have to add facilities to unpack executors from execution_contexts.
+     * So to use this with an execution_context you just have to call `ctx.get_executor()` before passing it to the constructor.
+     * @param exe The executor the service should use.
+     * @param options The options of the service.
+     */
+    explicit ModernIOService(ServiceExecutor &&exe, ModernIOServiceOptions options = {}) : impl{
+      make_impl(std::forward<ServiceExecutor>(exe), options)} {
+      impl->init();
+    }
+
+    ModernIOService(
+      ModernIOService &&) noexcept = default; // change default to delete if you don't want the service to be moveable
+    ModernIOService &operator=(ModernIOService &&) noexcept = default;
+
+    ModernIOService(const ModernIOService &) = delete;
+    ModernIOService &operator=(ModernIOService const &) = delete;
+
+    ~ModernIOService() {
+      CAS_LOG(info, "") << "ModernIOService destructor" << std::endl;
+      if (impl != nullptr) // a producer blocked by the memory budget must not keep the service alive forever
+        impl->memory->abort_waiters(); // only `shutdown` refuses later charges, clients may keep using the service
+    }
+
+    /// Creates a ModernIOServiceClient.
+    template<typename CallerExecutor>
+    requires my_is_executor<CallerExecutor>::value
+    detail::ModernIOServiceClient<CallerExecutor, ModernIOServiceImplType> make_client(CallerExecutor &exe) {
+      return detail::ModernIOServiceClient(impl, exe);
+    }
+
+    typedef void (async_shutdown_function)(boost::system::error_code ec, std::chrono::steady_clock::duration elapsed);
+
+    /**
+     * Shuts the service down and waits until the impl is destroyed on its strand.
+     * New writes fail with `shut_down`, parked reads get the remaining data or eof.
+     * Reads may drain the produced data until `deadline`.
+     * The wrapper is detached from the service right away, clients see `bad_descriptor` once the impl is gone.
+     *
+     * Completes with `timed_out` if data had to be discarded or ops in flight kept the impl alive past `deadline`.
+     * `elapsed` is the time from the call until the impl was destroyed, or until the deadline.
+     */
+    template<asio::completion_token_for<async_shutdown_function> CompletionToken>
+    auto async_shutdown(std::chrono::steady_clock::time_point deadline, CompletionToken &&token) {
+      return asio::async_initiate<CompletionToken, async_shutdown_function>(
+        [impl = std::move(impl), deadline, start = std::chrono::steady_clock::now()](auto completion_handler) mutable {
+          auto comp_executor = asio::get_associated_executor(completion_handler);
+          if (impl == nullptr) {
+            complete_at_initiation(comp_executor, std::move(completion_handler),
+                                   boost::system::error_code{asio::error::bad_descriptor}, std::chrono::steady_clock::duration{});
+            return;
+          }
+
+          auto strand = impl->strand;
+          CAS_ALLOC_SCOPE(co_spawn_frames);
+          asio::co_spawn(strand, [impl = std::move(impl), deadline, start, completion_handler = std::move(completion_handler),
+            work_guard = asio::make_work_guard(comp_executor)]() mutable -> asio::awaitable<void> {
+            auto use_awaitable = asio::bind_executor(co_await asio::this_coro::executor, asio::use_awaitable);
+            auto destroyed = std::make_shared<asio::steady_timer>(impl->strand, deadline);
+            impl->destroyed_signal = destroyed;
+
+            auto ec = co_await impl->shutdown(deadline);
+            impl.reset(); // the deleter destroys the impl once the ops in flight let go of it
+            co_await destroyed->async_wait(asio::experimental::as_tuple(use_awaitable));
+            if (destroyed->expiry() != std::chrono::steady_clock::time_point::min())
+              ec = asio::error::timed_out;
+
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            CAS_LOG(info, "") << "ModernIOService shut down in "
+                              << std::chrono::duration<double, std::milli>(elapsed).count() << "ms: " << ec.message() << std::endl;
+            asio::post(work_guard.get_executor(), [completion_handler = std::move(completion_handler), ec, elapsed]() mutable {
+              std::move(completion_handler)(ec, elapsed);
+            });
+          }, asio::detached);
+        }, token);
+    }
+  };
+
+  // region splice
+
+  /// Streams that expose their service through `lock_impl()`. Data can be moved between them without user buffers.
+  template<typename Stream>
+  concept service_backed_stream = requires(Stream &stream) {
+    stream.lock_impl()->buffer_in;
+    stream.lock_impl()->buffer_out;
+    stream.lock_impl()->strand;
+    stream.lock_impl()->closing;
+    stream.lock_impl()->memory;
+    stream.lock_impl()->ops_limiter;
+  };
+
+  namespace detail {
+    /// Size of each of the two buffers used by the pipelined fallback of `async_splice`.
+    static const constexpr size_t SPLICE_CHUNK_SIZE = 4096;
+
+    /**
+     * Reads from a service like a pipelined stream does.
+     * The read waits on the strand until data is available and only completes with eof and zero bytes
+     * once the service is done producing or shuts down. `MyAsyncStream::async_read_some` can't tell these apart
+     * from a momentarily empty `buffer_out`.
+     */
+    template<typename Impl, asio::completion_token_for<void(boost::system::error_code, size_t)> CompletionToken>
+    auto async_read_parked(std::shared_ptr<Impl> impl, std::shared_ptr<ReadPipeline> pipeline, asio::mutable_buffer buffer,
+                           CompletionToken &&token) {
+      return asio::async_initiate<CompletionToken, void(boost::system::error_code, size_t)>(
+        [impl = std::move(impl), pipeline = std::move(pipeline), buffer](auto completion_handler) mutable {
+          auto comp_executor = asio::get_associated_executor(completion_handler, impl->strand);
+          pipeline->outstanding++;
+          std::unique_ptr<ParkedRead> read = std::make_unique<ParkedReadOp<decltype(completion_handler),
+            decltype(asio::make_work_guard(comp_executor))>>(
+            buffer, std::move(completion_handler), asio::make_work_guard(comp_executor));
+          auto strand = impl->strand;
+          asio::post(strand, [impl = std::move(impl), pipeline = std::move(pipeline), read = std::move(read)]() mutable {
+            impl->park_read(pipeline, std::move(read));
+          });
+        }, token);
+    }
+
+    /**
+     * Both ends are backed by a service.
+     * The data is taken out of the `buffer_out` of the source and appended to the `buffer_in` of the sink.
+     * When the whole `buffer_out` fits into the remaining `max_bytes` it is taken without a copy,
+     * the only copy goes into the storage of the sink, which keeps its capacity.
+     * The sink treats each chunk like a write: it is charged to its memory budget and refused once it shuts down.
+     */
+    template<typename SourceStream, typename SinkStream>
+    asio::awaitable<std::tuple<boost::system::error_code, size_t>>
+    splice_service_backed(SourceStream &source, SinkStream &sink, size_t max_bytes) {
+      const constexpr auto TAG = "SPL";
+
+      auto source_impl = source.lock_impl();
+      auto sink_impl = sink.lock_impl();
+      if (source_impl == nullptr || sink_impl == nullptr)
+        co_return std::make_tuple(boost::system::error_code{asio::error::bad_descriptor}, size_t{0});
+
+      auto to_source = asio::bind_executor(source_impl->strand, asio::use_awaitable);
+      auto to_sink = asio::bind_executor(sink_impl->strand, asio::use_awaitable);
+
+      // A chunk the sink refused goes back to the front of the source, so no data is lost.
+      auto give_back = [&](std::string chunk) -> asio::awaitable<void> {
+        co_await asio::post(to_source);
+        {
+          CAS_ALLOC_SCOPE(service_buffers);
+          std::lock_guard lock{source_impl->buffers_mutex};
+          chunk += source_impl->buffer_out.view();
+          source_impl->buffer_out.assign(chunk);
+        }
+        source_impl->sync_memory_usage();
+        source_impl->serve_parked_reads();
+      };
+
+      auto pipeline = std::make_shared<ReadPipeline>(1);
+      size_t total = 0;
+      while (total < max_bytes) {
+        if (sink_impl->closing)
+          co_return std::make_tuple(boost::system::error_code{asio::error::shut_down}, total);
+
+        co_await asio::post(to_source);
+        std::string chunk;
+        {
+          std::lock_guard lock{source_impl->buffers_mutex};
+          if (source_impl->buffer_out.size() <= max_bytes - total) {
+            chunk = source_impl->buffer_out.take(); // ownership transfer unless a snapshot shares the data
+          } else {
+            chunk = source_impl->buffer_out.view().substr(0, max_bytes - total);
+            source_impl->buffer_out.erase(0, chunk.size());
+          }
+        }
+        source_impl->sync_memory_usage();
+        if (chunk.empty()) { // drained for now, wait for the next production, this copies the chunk once
+          chunk.resize(std::min(max_bytes - total, SPLICE_CHUNK_SIZE));
+          auto [read_ec, n] = co_await async_read_parked(source_impl, pipeline, asio::buffer(chunk), use_nothrow_awaitable);
+          chunk.resize(n);
+          if (chunk.empty()) // the source is done producing or shut down
+            co_return std::make_tuple(read_ec ? read_ec : boost::system::error_code{asio::stream_errc::eof}, total);
+        }
+
+        // Backpressure: wait until the memory budget of the sink allows the data.
+        auto size = chunk.size();
+        if (!sink_impl->memory->try_charge(size)) {
+          auto [charge_ec] = co_await sink_impl->memory->async_charge(size, use_nothrow_awaitable);
+          if (charge_ec) {
+            co_await give_back(std::move(chunk));
+            co_return std::make_tuple(charge_ec, total);
+          }
+        }
+
+        co_await asio::post(to_sink);
+        if (sink_impl->closing) {
+          sink_impl->memory->release(size);
+          co_await give_back(std::move(chunk));
+          co_return std::make_tuple(boost::system::error_code{asio::error::shut_down}, total);
+        }
+        sink_impl->adopt_charge(size);
+        CAS_BLOG(trace, TAG, "moving {} bytes", size);
+        total += size;
+        {
+          CAS_ALLOC_SCOPE(service_buffers);
+          std::lock_guard lock{sink_impl->buffers_mutex};
+          sink_impl->buffer_in += chunk; // into the storage reserved by `prewarm`, replacing it would drop the capacity
+        }
+        sink_impl->sync_memory_usage();
+      }
+      co_return std::make_tuple(boost::system::error_code{}, total);
+    }
+
+    /// Wraps the result in a pair. Awaitable operators would flatten a tuple.
+    template<typename Awaitable>
+    asio::awaitable<std::pair<boost::system::error_code, size_t>> as_pair(Awaitable operation) {
+      auto [ec, n] = co_await std::move(operation);
+      co_return std::make_pair(ec, n);
+    }
+
+    /**
+     * Generic AsyncReadStream to AsyncWriteStream splice.
+     * Uses two buffers so that the write of one chunk overlaps with the read of the next one.
+     * The source ends with a read of zero bytes. A service backed source is read with `async_read_parked`,
+     * so that a momentarily drained service doesn't end the splice.
+     */
+    template<typename SourceStream, typename SinkStream>
+    asio::awaitable<std::tuple<boost::system::error_code, size_t>>
+    splice_pipelined(SourceStream &source, SinkStream &sink, size_t max_bytes) {
+      using namespace asio::experimental::awaitable_operators;
+
+      std::array<std::vector<char>, 2> buffers;
+      for (auto &buffer: buffers)
+        buffer.resize(std::min(max_bytes, SPLICE_CHUNK_SIZE));
+
+      size_t read_total = 0, written = 0;
+      auto pipeline = std::make_shared<ReadPipeline>(1);
+      auto read_chunk = [&](std::vector<char> &buffer) -> asio::awaitable<std::tuple<boost::system::error_code, size_t>> {
+        auto chunk = asio::buffer(buffer.data(), std::min(buffer.size(), max_bytes - read_total));
+        if constexpr (service_backed_stream<SourceStream>) {
+          auto source_impl = source.lock_impl();
+          if (source_impl == nullptr)
+            co_return std::make_tuple(boost::system::error_code{asio::error::bad_descriptor}, size_t{0});
+          co_return co_await async_read_parked(std::move(source_impl), pipeline, chunk, use_nothrow_awaitable);
+        } else {
+          co_return co_await source.async_read_some(chunk, use_nothrow_awaitable);
+        }
+      };
+
+      size_t current = 0;
+      auto [ec, n] = co_await read_chunk(buffers[current]);
+      while (true) {
+        // The data of a read is valid even if it reports an error, e.g. eof once the buffer of a MyAsyncStream is drained.
+        // Only a read without data ends the splice.
+        if (n != 0 && (ec == asio::error::no_buffer_space || ec == asio::stream_errc::eof))
+          ec = {};
+        read_total += n;
+
+        if (n == 0 || ec || read_total >= max_bytes) { // last chunk, nothing to overlap with
+          if (n != 0) {
+            auto [write_ec, write_n] = co_await asio::async_write(sink, asio::buffer(buffers[current].data(), n),
+                                                                   use_nothrow_awaitable);
+            written += write_n;
+            if (write_n != n)
+              ec = write_ec;
+          }
+          break;
+        }
+
+        auto next = 1 - current;
+        auto [write_result, read_result] = co_await (
+          as_pair(asio::async_write(sink, asio::buffer(buffers[current].data(), n), use_nothrow_awaitable)) &&
+          as_pair(read_chunk(buffers[next])));
+
+        auto [write_ec, write_n] = write_result;
+        written += write_n;
+        if (write_n != n) { // only an incomplete write is an error, MyAsyncStream always reports eof
+          ec = write_ec;
+          break;
+        }
+        std::tie(ec, n) = read_result;
+        current = next;
+      }
+      co_return std::make_tuple(ec, written);
+    }
+  }
+
+  typedef void async_splice_handler(boost::system::error_code, size_t);
+
+  /**
+   * Moves up to `max_bytes` from `source` to `sink`.
+   * Completes with eof when the source ends before `max_bytes` were moved.
+   * A service backed source only ends once its service is done producing or shuts down, until then the splice waits for data.
+   *
+   * When both streams are service backed the chunks are moved by ownership transfer.
+   * Otherwise, it falls back to double buffered pipelining with overlapping reads and writes.
+   *
+   * The streams must outlive the operation.
+   */
+  template<typename SourceStream, typename SinkStream,
+    asio::completion_token_for<async_splice_handler>
+    CompletionToken = typename asio::default_completion_token<typename SourceStream::executor_type>::type>
+  auto async_splice(SourceStream &source, SinkStream &sink, size_t max_bytes,
+                    CompletionToken &&token = typename asio::default_completion_token<typename SourceStream::executor_type>::type()) {
+    return asio::async_initiate<CompletionToken, async_splice_handler>(
+      [&source, &sink, max_bytes](auto completion_handler) {
+        CAS_ALLOC_SCOPE(stream_ops);
+        auto comp_executor = asio::get_associated_executor(completion_handler, source.get_executor());
+        // The pipelined fallback writes through `async_write_some` which is limited already.
+        // A direct splice bypasses it, so it counts against the limiter of the sink like a write.
+        std::shared_ptr<ConcurrencyLimiter> limiter;
+        if constexpr (service_backed_stream<SourceStream> && service_backed_stream<SinkStream>) {
+          if (auto sink_impl = sink.lock_impl(); sink_impl != nullptr)
+            limiter = sink_impl->ops_limiter;
+        }
+        limit_initiation<async_splice_handler>(limiter, comp_executor, std::move(completion_handler),
+                                               [&source, &sink, max_bytes](auto comp_executor, auto completion_handler) {
+          CAS_ALLOC_SCOPE(co_spawn_frames);
+          asio::co_spawn(comp_executor, [&source, &sink, max_bytes, completion_handler = std::move(completion_handler)]
+            () mutable -> asio::awaitable<void> {
+            auto comp_executor = co_await asio::this_coro::executor;
+            auto to_comp = asio::bind_executor(comp_executor, asio::use_awaitable);
+
+            std::tuple<boost::system::error_code, size_t> result;
+            if constexpr (service_backed_stream<SourceStream> && service_backed_stream<SinkStream>)
+              result = co_await detail::splice_service_backed(source, sink, max_bytes);
+            else
+              result = co_await detail::splice_pipelined(source, sink, max_bytes);
+
+            co_await asio::post(to_comp);
+            std::apply(std::move(completion_handler), result);
+          }, asio::detached);
+        });
+      }, token);
+  }
+
+  // endregion
+}
+
+#endif //CUSTOMASIOSTREAMS_MODERNIOSERVICE_H
@@ -0,0 +1,260 @@
+/* Copyright 2022 The CustomAsioAsyncStreams Contributors.
+This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+You should have received a copy of the GNU General Public License along with this program. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUSTOMASIOSTREAMS_SEGMENTEDLOG_H
+#define CUSTOMASIOSTREAMS_SEGMENTEDLOG_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * An append only log of records which is split into segments.
+ *
+ * Every byte has an offset which never changes, even when older segments are removed.
+ * The index is sparse: there is one entry per segment (its offset range).
+ * A lookup is a binary search over the segments followed by a binary search over the records of one segment.
+ *
+ * Retention and compaction are done in small steps so that the caller can spread them over time.
+ * Only the last (active) segment is appended to, all other segments are sealed.
+ *
+ * The log is not thread safe. The service only accesses it on its strand.
+ */
+class SegmentedLog {
+public:
+  using clock = std::chrono::steady_clock;
+  /// Extracts the key of a record for key based compaction.
+  using KeyFunction = std::function<std::string_view(std::string_view record)>;
+
+  /// A record is the unit of an append.
+  struct Record {
+    /// Offset of the first byte of the record.
+    uint64_t offset;
+    /// Position of the record in the data of its segment.
+    size_t position;
+    size_t size;
+
+    uint64_t end_offset() const {
+      return offset + size;
+    }
+  };
+
+  struct Segment {
+    /// The data of all records without gaps.
+    std::string data;
+    /// Sorted by offset.
+    std::vector<Record> records;
+    /// Time of the last append.
+    clock::time_point last_append;
+
+    uint64_t begin_offset() const {
+      return records.front().offset;
+    }
+
+    uint64_t end_offset() const {
+      return records.back().end_offset();
+    }
+  };
+
+  /// Result of a read.
+  struct Read {
+    /// The offset of the first byte that was read.
+    uint64_t offset;
+    size_t size;
+  };
+
+private:
+  /// Never contains empty segments.
+  std::deque<Segment> segments;
+  /// The offset the next append gets.
+  uint64_t next_offset = 0;
+  /// The size at which a new segment is started.
+  size_t segment_bytes;
+  /// Bytes of record data held by the log.
+  size_t retained_bytes = 0;
+  /// Only set if key based compaction is used.
+  KeyFunction key_of;
+  /// The offset of the newest record of every key.
+  std::unordered_map<std::string, uint64_t> latest_by_key;
+
+  std::string_view record_data(const Segment &segment, const Record &record) const {
+    return std::string_view{segment.data}.substr(record.position, record.size);
+  }
+
+  /// Removes a whole segment and forgets the keys whose newest record was in it.
+  void erase_segment(std::deque<Segment>::iterator segment) {
+    if (key_of) {
+      for (auto &record: segment->records) {
+        auto it = latest_by_key.find(std::string{key_of(record_data(*segment, record))});
+        if (it != latest_by_key.end() && it->second == record.offset)
+          latest_by_key.erase(it);
+      }
+    }
+    retained_bytes -= segment->data.size();
+    segments.erase(segment);
+  }
+
+public:
+  /**
+   * @param segment_bytes The size at which a new segment is started.
+   * @param key_of Enables key based compaction. Only the newest record of every key is kept in sealed segments.
+   */
+  explicit SegmentedLog(size_t segment_bytes = 4096, KeyFunction key_of = {}) : segment_bytes{segment_bytes},
+                                                                                key_of{std::move(key_of)} {}
+
+  /**
+   * Appends a record.
+   * @return The offset of the first byte of the record.
+   */
+  uint64_t append(std::string_view record) {
+    auto offset = next_offset;
+    if (record.empty())
+      return offset;
+
+    if (segments.empty() || segments.back().data.size() + record.size() > segment_bytes)
+      segments.emplace_back().data.reserve(std::max(segment_bytes, record.size()));
+
+    auto &segment = segments.back();
+    segment.records.push_back(Record{offset, segment.data.size(), record.size()});
+    segment.data += record;
+    segment.last_append = clock::now();
+    if (key_of)
+      latest_by_key.insert_or_assign(std::string{key_of(record)}, offset);
+
+    next_offset += record.size();
+    retained_bytes += record.size();
+    return offset;
+  }
+
+  /// @return The offset of the oldest retained byte. Equal to `end_offset()` when the log is empty.
+  uint64_t begin_offset() const {
+    return segments.empty() ? next_offset : segments.front().begin_offset();
+  }
+
+  /// @return The offset the next append gets.
+  uint64_t end_offset() const {
+    return next_offset;
+  }
+
+  /// @return The number of bytes retained by the log.
+  size_t size_bytes() const {
+    return retained_bytes;
+  }
+
+  // region retention
+
+  /**
+   * Removes the oldest segment if its newest record is older than `max_age`.
+   * @return If a segment was removed.
+   */
+  bool expire_step(clock::time_point now, clock::duration max_age) {
+    if (segments.empty() || now - segments.front().last_append <= max_age)
+      return false;
+    erase_segment(segments.begin());
+    return true;
+  }
+
+  /**
+   * Removes the oldest sealed segment if the log is larger than `max_bytes`.
+   * The active segment is never removed.
+   * @return If a segment was removed.
+   */
+  bool trim_step(size_t max_bytes) {
+    if (segments.size() < 2 || retained_bytes <= max_bytes)
+      return false;
+    erase_segment(segments.begin());
+    return true;
+  }
+
+  /**
+   * Compacts the first sealed segment that ends after `cursor`.
+   * Records that are not the newest record of their key are removed. Their offsets become gaps.
+   * @param cursor Advanced past the compacted segment. Start with 0 for a full pass.
+   * @return If a segment was compacted. False when the pass is complete.
+   */
+  bool compact_step(uint64_t &cursor) {
+    if (!key_of)
+      return false;
+    auto segment = std::upper_bound(segments.begin(), segments.end(), cursor,
+                                    [](uint64_t cursor, const Segment &segment) {
+                                      return cursor < segment.end_offset();
+                                    });
+    if (segment == segments.end() || std::next(segment) == segments.end()) // only sealed segments
+      return false;
+    cursor = segment->end_offset();
+
+    Segment compacted;
+    compacted.last_append = segment->last_append;
+    for (auto &record: segment->records) {
+      auto data = record_data(*segment, record);
+      auto it = latest_by_key.find(std::string{key_of(data)});
+      if (it == latest_by_key.end() || it->second != record.offset)
+        continue;
+      compacted.records.push_back(Record{record.offset, compacted.data.size(), record.size});
+      compacted.data += data;
+    }
+
+    retained_bytes -= segment->data.size() - compacted.data.size();
+    if (compacted.records.empty())
+      segments.erase(segment);
+    else
+      *segment = std::move(compacted);
+    return true;
+  }
+
+  // endregion
+
+  /**
+   * Copies the data starting at `offset` into `out`.
+   * Only contiguous data is copied, so the read stops at gaps left by removed records.
+   * If `offset` itself was removed the read starts at the next retained record.
+   * @return The offset of the first copied byte and the number of bytes copied.
+   *         The size is zero if there is no data at or after `offset`.
+   */
+  Read read(uint64_t offset, std::span<char> out) const {
+    // The first segment that ends after the offset
+    auto segment = std::upper_bound(segments.begin(), segments.end(), offset,
+                                    [](uint64_t offset, const Segment &segment) {
+                                      return offset < segment.end_offset();
+                                    });
+    if (segment == segments.end())
+      return {next_offset, 0};
+
+    // The first record that ends after the offset
+    auto record = std::upper_bound(segment->records.begin(), segment->records.end(), offset,
+                                   [](uint64_t offset, const Record &record) {
+                                     return offset < record.end_offset();
+                                   });
+    auto first = std::max(offset, record->offset);
+
+    Read result{first, 0};
+    auto expected = first;
+    while (result.size < out.size() && segment != segments.end()) {
+      for (; record != segment->records.end() && result.size < out.size(); ++record) {
+        if (record->offset > expected) // gap
+          return result;
+        auto skip = expected - record->offset;
+        auto n = std::min(record->size - skip, out.size() - result.size);
+        std::memcpy(out.data() + result.size, segment->data.data() + record->position + skip, n);
+        result.size += n;
+        expected += n;
+      }
+      if (++segment != segments.end())
+        record = segment->records.begin();
+    }
+    return result;
+  }
+};
+
+#endif //CUSTOMASIOSTREAMS_SEGMENTEDLOG_H